@@ -0,0 +1,87 @@
+/*
+ * AsyncSink.h
+ *
+ * Part of a general library.
+ *
+ * @author Freark van der Berg
+ */
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#include "libfrugi/OutputSink.h"
+
+namespace libfrugi {
+
+/**
+ * An OutputSink that hands the chunks to another sink on a background
+ * thread, so the thread producing the output does not wait for the disk.
+ * The chunks are queued in a bounded queue. When the queue is full, write()
+ * blocks until the background thread caught up, which bounds the memory
+ * used. flush(), sync() and close() wait until the queue is empty, so they
+ * give deterministic completion.
+ * For example, to write to a file in the background:
+ *   FileDescriptorSink* fileSink;
+ *   if(!FileDescriptorSink::open(path, fileSink)) writer.setSink(new AsyncSink(fileSink));
+ */
+class AsyncSink : public OutputSink {
+private:
+    OutputSink* inner;
+    size_t capacity;
+    std::deque<SegmentBuffer::ChunkList> queue;
+    bool busy;
+    bool stopping;
+    size_t stalls;
+    std::mutex mutex;
+    std::condition_variable workAvailable;
+    std::condition_variable spaceAvailable;
+    std::thread thread;
+
+    void run();
+
+    /**
+     * Waits until the background thread finished writing all queued chunks.
+     */
+    void drain();
+
+public:
+
+    /**
+     * The default number of chunk lists that can be queued, which gives
+     * double buffering: one being written while the next one is filled.
+     */
+    static const size_t CAPACITY_DEFAULT;
+
+    /**
+     * Creates a new AsyncSink writing to the specified sink, which it takes
+     * ownership of.
+     * @param inner The sink to write to on the background thread.
+     * @param capacity The maximum number of chunk lists waiting to be written.
+     */
+    AsyncSink(OutputSink* inner, size_t capacity = CAPACITY_DEFAULT);
+
+    virtual ~AsyncSink();
+
+    virtual void write(SegmentBuffer::ChunkList chunks);
+
+    virtual int flush();
+
+    virtual int sync();
+
+    virtual int close();
+
+    /**
+     * Returns the number of times write() had to wait because the queue
+     * was full, i.e., because the disk could not keep up.
+     * @return The number of times write() had to wait.
+     */
+    size_t getStalls() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return stalls;
+    }
+};
+
+} // namespace libfrugi
@@ -0,0 +1,428 @@
+/*
+ * BinaryLog.h
+ *
+ * Part of a general library.
+ *
+ * @author Freark van der Berg
+ */
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+#include "libfrugi/FileWriter.h"
+#include "libfrugi/MessageFormatter.h"
+
+namespace libfrugi {
+
+/**
+ * The BinaryLog class writes log messages in a compact binary form, to be
+ * rendered to text later by the frugi-logdecode tool or decode(). Each call
+ * site registers its format string, message type and argument types once,
+ * using LIBFRUGI_LOG(). Logging a message then only copies the id of the
+ * call site, a timestamp and the raw arguments into a ring buffer of the
+ * calling thread, without taking a lock or formatting anything. A
+ * background thread moves the contents of the ring buffers to the file,
+ * merging the messages of the threads in order of their timestamps.
+ * For example:
+ *   BinaryLog log;
+ *   log.open("run.log");
+ *   LIBFRUGI_LOG(log, MessageFormatter::MessageType::Action, "visited {} states in {}s", states, seconds);
+ * The format string uses "{}" for each argument. Arguments can be
+ * integers, floating point numbers, characters, booleans and strings;
+ * strings longer than STRING_MAX are truncated.
+ * Existing reporting code can use a BinaryLog as well, through
+ * MessageFormatter::setBinaryLog(). Those messages are formatted by the
+ * caller already, so they are stored as text along with their location and
+ * indentation; only the printing is deferred.
+ * The file consists of a header followed by entries, each of which starts
+ * with the id of its call site and its size. The header holds the id of the
+ * writing process. Entries with id 0 define a call site and precede the
+ * first message of that call site. Numbers are stored in the byte order of
+ * the host.
+ */
+class BinaryLog {
+public:
+
+    /**
+     * The description of a call site.
+     */
+    class Site {
+    public:
+        enum Flags {
+
+            /**
+             * The arguments start with the location and indentation of the
+             * message: its file name, first line, first column, last line,
+             * last column and indentation. These are not part of the format.
+             */
+            LOCATED = 1
+        };
+
+        MessageFormatter::MessageType::MType type;
+        const char* file;
+        unsigned int line;
+        const char* format;
+        const char* argTypes;
+        unsigned int flags;
+    };
+
+    /**
+     * The default size of the ring buffer of each thread in bytes.
+     */
+    static const size_t RING_SIZE_DEFAULT;
+
+    /**
+     * The maximum number of bytes of a string argument that is logged.
+     */
+    static const size_t STRING_MAX;
+
+    /**
+     * The id of entries defining a call site.
+     */
+    static const uint32_t ID_SITE;
+
+    /**
+     * The id of entries filling up the end of a ring buffer.
+     */
+    static const uint32_t ID_PADDING;
+
+    /**
+     * Returns the character identifying how arguments of type T are stored.
+     * @return The type code of T.
+     */
+    template<typename T>
+    static constexpr char typeCode() {
+        if constexpr(std::is_same_v<T, bool>) {
+            return 'b';
+        } else if constexpr(std::is_same_v<T, char>) {
+            return 'c';
+        } else if constexpr(std::is_integral_v<T> && std::is_signed_v<T>) {
+            return 'i';
+        } else if constexpr(std::is_integral_v<T>) {
+            return 'u';
+        } else if constexpr(std::is_floating_point_v<T>) {
+            return 'd';
+        } else if constexpr(std::is_convertible_v<T, std::string_view>) {
+            return 's';
+        } else {
+            static_assert(std::is_integral_v<T>, "type cannot be logged by BinaryLog");
+            return 0;
+        }
+    }
+
+    /**
+     * The type codes of a list of argument types, as a string.
+     */
+    template<typename... Args>
+    class Signature {
+    public:
+        static constexpr char value[] = {typeCode<Args>()..., '\0'};
+    };
+
+    /**
+     * Registers a call site, returning its id.
+     * @return The id of the call site.
+     */
+    static uint32_t registerSite(const MessageFormatter::MessageType& type, const char* file, unsigned int line,
+                                 const char* format, const char* argTypes, unsigned int flags = 0);
+
+private:
+
+    /**
+     * The ring buffer of a thread. Entries never wrap around the end: if an
+     * entry does not fit before the end, the rest is filled with a padding
+     * entry. The tail is only published once an entry is complete; pending
+     * is where it will be, only used by the owning thread. A ring is retired
+     * when its thread exits, and removed once it has been drained.
+     */
+    class Ring {
+    public:
+        alignas(64) std::atomic<size_t> head;
+        alignas(64) std::atomic<size_t> tail;
+        size_t pending;
+        char* data;
+        size_t capacity;
+        std::thread::id thread;
+        std::atomic<bool> retired;
+
+        Ring(size_t capacity) : head(0), tail(0), pending(0), data(new char[capacity]), capacity(capacity),
+                                thread(std::this_thread::get_id()), retired(false) {
+        }
+
+        ~Ring() {
+            delete[] data;
+        }
+    };
+
+    /**
+     * The ring buffers of a thread, which are retired when it exits. The
+     * rings are shared with their logs, so either can go first.
+     */
+    class RingOwner {
+    public:
+        std::vector<std::shared_ptr<Ring>> owned;
+
+        ~RingOwner() {
+            for(auto& ring: owned) {
+                ring->retired.store(true, std::memory_order_release);
+            }
+        }
+    };
+
+    static std::atomic<unsigned long> serials;
+
+    FileWriter file;
+    size_t ringSize;
+    std::atomic<bool> opened;
+    std::atomic<unsigned long> serial;
+    std::mutex ringsMutex;
+    std::vector<std::shared_ptr<Ring>> rings;
+    std::unordered_map<std::thread::id, Ring*> threadRings;
+    std::mutex drainMutex;
+    std::mutex stopMutex;
+    std::condition_variable stopRequested;
+    bool stopping;
+    std::thread drainer;
+    uint32_t sitesWritten;
+    std::vector<Ring*> drainRings;
+    std::vector<size_t> drainTails;
+    std::vector<bool> drainRetired;
+    std::vector<size_t> drainHeads;
+    std::vector<uint64_t> drainNext;
+    std::atomic<size_t> stalls;
+    std::atomic<size_t> dropped;
+
+    static size_t align(size_t n) {
+        return (n + 7) & ~(size_t)7;
+    }
+
+    template<typename T>
+    static std::string_view toString(const T& arg) {
+        if constexpr(std::is_pointer_v<T>) {
+            if(!arg) return std::string_view();
+        }
+        return std::string_view(arg);
+    }
+
+    template<typename T>
+    static size_t argSize(const T& arg) {
+        if constexpr(typeCode<T>() == 's') {
+            return sizeof(uint32_t) + std::min(toString(arg).size(), STRING_MAX);
+        } else if constexpr(typeCode<T>() == 'b' || typeCode<T>() == 'c') {
+            return 1;
+        } else {
+            return 8;
+        }
+    }
+
+    template<typename T>
+    static char* putArg(char* p, const T& arg) {
+        if constexpr(typeCode<T>() == 's') {
+            std::string_view s = toString(arg);
+            uint32_t n = (uint32_t)std::min(s.size(), STRING_MAX);
+            memcpy(p, &n, sizeof(n));
+            memcpy(p + sizeof(n), s.data(), n);
+            return p + sizeof(n) + n;
+        } else if constexpr(typeCode<T>() == 'b' || typeCode<T>() == 'c') {
+            *p = (char)arg;
+            return p + 1;
+        } else if constexpr(typeCode<T>() == 'i') {
+            int64_t v = arg;
+            memcpy(p, &v, sizeof(v));
+            return p + sizeof(v);
+        } else if constexpr(typeCode<T>() == 'u') {
+            uint64_t v = arg;
+            memcpy(p, &v, sizeof(v));
+            return p + sizeof(v);
+        } else {
+            double v = arg;
+            memcpy(p, &v, sizeof(v));
+            return p + sizeof(v);
+        }
+    }
+
+    /**
+     * Returns the id of the call site used for messages of the specified
+     * type reported through a MessageFormatter, registering it the first
+     * time.
+     */
+    static uint32_t messageSite(const MessageFormatter::MessageType& type);
+
+    /**
+     * Returns the ring buffer of the calling thread.
+     */
+    Ring& threadRing();
+
+    /**
+     * Returns a pointer to @c size contiguous bytes in the ring buffer,
+     * waiting until the background thread made room if needed.
+     */
+    char* reserve(Ring& ring, size_t size);
+
+    /**
+     * Moves the contents of all ring buffers to the file, preceded by the
+     * definitions of call sites that were not written yet. The messages of
+     * the threads are merged in order of their timestamps. Unless @c all is
+     * set, messages logged during the last drain interval are left in the
+     * ring buffers, so a message that another thread is still copying into
+     * its ring buffer is not overtaken by later ones.
+     */
+    void drain(bool all);
+
+    /**
+     * Returns the timestamp of the message at @c head in the ring buffer,
+     * skipping padding, or UINT64_MAX if there is none before @c tail.
+     */
+    static uint64_t nextTimestamp(const Ring& ring, size_t& head, size_t tail);
+
+    void run();
+
+    /**
+     * Copies a message of the specified call site into the ring buffer of
+     * the calling thread.
+     */
+    template<typename... Args>
+    void writeRecord(uint32_t site, const Args& ... args) {
+        if(!opened.load(std::memory_order_relaxed)) return;
+        size_t size = align(2 * sizeof(uint32_t) + sizeof(uint64_t) + (argSize(args) + ... + 0));
+        Ring& ring = threadRing();
+        if(size > ring.capacity / 2) {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        char* p = reserve(ring, size);
+        uint32_t header[2] = {site, (uint32_t)size};
+        uint64_t timestamp = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+        memcpy(p, header, sizeof(header));
+        memcpy(p + sizeof(header), &timestamp, sizeof(timestamp));
+        p += sizeof(header) + sizeof(timestamp);
+        ((p = putArg(p, args)), ...);
+        ring.tail.store(ring.pending, std::memory_order_release);
+    }
+
+public:
+
+    BinaryLog();
+
+    BinaryLog(const BinaryLog&) = delete;
+
+    BinaryLog& operator=(const BinaryLog&) = delete;
+
+    /**
+     * Writes the remaining messages and closes the file.
+     */
+    virtual ~BinaryLog();
+
+    /**
+     * Creates or truncates the specified file, writes the header and starts
+     * the background thread. Messages logged before are discarded.
+     * @param path The path of the file to write to.
+     * @param ringSize The size of the ring buffer of each thread in bytes.
+     * @return 0 on success, an errno value otherwise.
+     */
+    int open(const std::string& path, size_t ringSize = RING_SIZE_DEFAULT);
+
+    /**
+     * Writes the remaining messages, stops the background thread and closes
+     * the file. No messages should be logged concurrently.
+     * @return 0 on success, an errno value otherwise.
+     */
+    int close();
+
+    /**
+     * Writes all messages logged before this call to the file.
+     * @return 0 on success, an errno value otherwise.
+     */
+    int flush();
+
+    /**
+     * Logs a message. The call site is identified by the type @c Tag, which
+     * should be unique to it, and is registered the first time. Use
+     * LIBFRUGI_LOG() instead, which passes a local class as the tag.
+     * @param type The type of the message.
+     * @param file The source file of the call site.
+     * @param line The line of the call site.
+     * @param format The format string, with "{}" for each argument.
+     * @param args The arguments.
+     */
+    template<typename Tag, typename... Args>
+    void write(const MessageFormatter::MessageType& type, const char* file, unsigned int line, const char* format,
+               const Args& ... args) {
+        static const uint32_t site = registerSite(type, file, line, format,
+                                                  Signature<std::decay_t<Args>...>::value);
+        writeRecord(site, args...);
+    }
+
+    /**
+     * Logs a message that is formatted already, along with its location and
+     * indentation. Used by MessageFormatter::setBinaryLog().
+     * @param loc The location of the message.
+     * @param str The text of the message.
+     * @param type The type of the message.
+     * @param indent The indentation of the message.
+     */
+    void message(const Location& loc, const std::string& str, const MessageFormatter::MessageType& type,
+                 int indent);
+
+    /**
+     * Returns the number of times a thread had to wait because its ring
+     * buffer was full.
+     * @return The number of times a thread had to wait.
+     */
+    size_t getStalls() const { return stalls.load(std::memory_order_relaxed); }
+
+    /**
+     * Returns the number of messages discarded because they were larger
+     * than half a ring buffer.
+     * @return The number of discarded messages.
+     */
+    size_t getDropped() const { return dropped.load(std::memory_order_relaxed); }
+
+    /**
+     * Renders the messages in the specified binary log to the specified
+     * MessageFormatter, in the order in which they were written to the file.
+     * That is the order of their timestamps, except that a message may
+     * follow later messages of other threads if its thread was suspended
+     * while copying it into its ring buffer, or if the log was flushed while
+     * it was being copied.
+     * Each message is reported with the id of the process that wrote the
+     * log. Messages logged using LIBFRUGI_LOG() are located at their call
+     * site.
+     * @param path The path of the binary log.
+     * @param formatter The MessageFormatter to report the messages to.
+     * @param timestamps Whether to prefix each message with the number of
+     *                   seconds since the log was opened.
+     * @return 0 on success, EINVAL if the file is not a valid binary log, or
+     *         an errno value otherwise.
+     */
+    static int decode(const std::string& path, MessageFormatter& formatter, bool timestamps);
+};
+
+} // namespace libfrugi
+
+/**
+ * Logs a message to the specified BinaryLog. The format string must be a
+ * string literal or otherwise outlive the program; it is registered along
+ * with the message type and the types of the arguments the first time the
+ * call site is executed. The arguments are only evaluated once.
+ */
+#define LIBFRUGI_LOG(log, mType, format, ...) \
+    do { \
+        struct libfrugi_site { \
+        }; \
+        (log).write<libfrugi_site>((mType), __FILE__, __LINE__, (format), ##__VA_ARGS__); \
+    } while(0)
@@ -0,0 +1,81 @@
+/*
+ * CompressingSink.h
+ *
+ * Part of a general library.
+ *
+ * @author Freark van der Berg
+ */
+#pragma once
+
+#include "libfrugi/OutputSink.h"
+
+namespace libfrugi {
+
+/**
+ * An OutputSink compressing the chunks before handing them to another sink.
+ * The data is compressed block by block as the FileWriter drains its buffer,
+ * so the uncompressed output is never written to disk. Compression runs on
+ * the thread calling write(); wrap the sink in an AsyncSink to let it run on
+ * a helper thread and overlap with formatting, as FileWriter::openCompressed()
+ * does.
+ * Which formats are available depends on the libraries found when building;
+ * see isSupported().
+ */
+class CompressingSink : public OutputSink {
+public:
+    enum Format {
+        GZIP,
+        ZSTD
+    };
+
+private:
+    class State;
+
+    OutputSink* inner;
+    Format format;
+    State* state;
+    bool pending;
+    int error;
+
+    /**
+     * Compresses the specified data, or finishes a block if @c data is
+     * nullptr, and writes the result to the inner sink.
+     * @param mode What to do after the data: continue, flush or end.
+     */
+    void compress(const SegmentBuffer::Chunk* chunks, int mode);
+
+public:
+
+    /**
+     * The default compression level, a trade-off favouring speed.
+     */
+    static const int LEVEL_DEFAULT;
+
+    /**
+     * Creates a new CompressingSink writing to the specified sink, which it
+     * takes ownership of.
+     * @param inner The sink to write the compressed data to.
+     * @param format The compression format to use.
+     * @param level The compression level, or LEVEL_DEFAULT.
+     */
+    CompressingSink(OutputSink* inner, Format format, int level = LEVEL_DEFAULT);
+
+    virtual ~CompressingSink();
+
+    /**
+     * Returns whether the specified format is available in this build.
+     * @param format The format to check.
+     * @return Whether the format is available.
+     */
+    static bool isSupported(Format format);
+
+    virtual void write(SegmentBuffer::ChunkList chunks);
+
+    virtual int flush();
+
+    virtual int sync();
+
+    virtual int close();
+};
+
+} // namespace libfrugi
@@ -7,30 +7,123 @@
  */
 #pragma once
 
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
 #include "FileWriter.h"
 
 namespace libfrugi {
 
 /**
  * The ConsoleWriter is a FileWriter with support to colour the output if the
- * specified output stream is std::cout or std::cerr.
+ * specified output stream is std::cout or std::cerr and that stream is
+ * connected to a terminal supporting colours.
  */
 class ConsoleWriter : public FileWriter {
 public:
-    class Color {
-    public:
-        char code[4];
 
-        Color(char code) : code{code, 0, 0, 0} {
-        }
+    /**
+     * The capabilities of the terminal an output stream is connected to.
+     * They are detected once per file descriptor and cached.
+     */
+    class Terminal {
+    public:
 
-        Color(char code1, char code2) : code{code1, code2, 0, 0} {
+        /**
+         * Whether the file descriptor refers to a terminal.
+         */
+        bool tty;
+
+        /**
+         * Whether colours should be written: the file descriptor refers to a
+         * terminal, NO_COLOR is not set and TERM is set and not "dumb". A
+         * non-empty FORCE_COLOR other than "0" enables colours regardless.
+         */
+        bool colors;
+
+        /**
+         * The number of columns of the terminal, taken from the terminal
+         * itself or from COLUMNS, or 0 if unknown.
+         */
+        int width;
+
+        Terminal() : tty(false), colors(false), width(0) {
         }
 
-        Color(char code1, char code2, char code3) : code{code1, code2, code3, 0} {
-        }
+        /**
+         * Returns the capabilities of the terminal connected to the specified
+         * file descriptor. The detection is done once for standard output and
+         * standard error; for other file descriptors it is done every call.
+         * @param fd The file descriptor.
+         * @return The capabilities of the terminal.
+         */
+        static const Terminal& get(int fd);
+
+        /**
+         * Detects the capabilities of the terminal connected to the specified
+         * file descriptor.
+         * @param fd The file descriptor.
+         * @return The capabilities of the terminal.
+         */
+        static Terminal detect(int fd);
+    };
 
-        Color(char code1, char code2, char code3, char code4) : code{code1, code2, code3, code4} {
+    /**
+     * A colour or attribute change, consisting of up to four SGR codes. The
+     * escape sequence and the effect of the codes on the terminal state are
+     * computed when the Color is constructed.
+     */
+    class Color {
+    public:
+        char code[4];
+        char escape[20];
+        unsigned char length;
+
+        /**
+         * The effect on the terminal state: whether all attributes are reset
+         * first, the bold attribute afterwards (-1 if unchanged), the
+         * foreground and background colours (-1 if unchanged) and whether the
+         * codes have effects that are not tracked.
+         */
+        bool reset;
+        signed char bold;
+        signed char foreground;
+        signed char background;
+        bool untracked;
+
+        constexpr Color(char code1, char code2 = 0, char code3 = 0, char code4 = 0)
+                : code{code1, code2, code3, code4}, escape{}, length(0), reset(false), bold(-1), foreground(-1),
+                  background(-1), untracked(false) {
+            escape[length++] = '\033';
+            escape[length++] = '[';
+            for(int i = 0; i < 4 && (i == 0 || code[i]); ++i) {
+                int c = (unsigned char)code[i];
+                if(i > 0) escape[length++] = ';';
+                if(c >= 100) escape[length++] = char('0' + c / 100);
+                if(c >= 10) escape[length++] = char('0' + c / 10 % 10);
+                escape[length++] = char('0' + c % 10);
+
+                if(c == 0) {
+                    reset = true;
+                    bold = 0;
+                    foreground = background = -1;
+                } else if(c == 1) {
+                    bold = 1;
+                } else if(c == 22) {
+                    bold = 0;
+                } else if((c >= 30 && c <= 37) || c == 39 || (c >= 90 && c <= 97)) {
+                    foreground = (signed char)c;
+                } else if((c >= 40 && c <= 47) || c == 49 || (c >= 100 && c <= 107)) {
+                    background = (signed char)c;
+                } else {
+                    untracked = true;
+                }
+            }
+            escape[length++] = 'm';
         }
 
     public:
@@ -85,11 +178,131 @@ public:
     };
 
 private:
+
+    /**
+     * The attributes of the terminal as set by the colours written so far.
+     */
+    class ColorState {
+    public:
+        bool known;
+        bool bold;
+        signed char foreground;
+        signed char background;
+
+        ColorState() : known(false), bold(false), foreground(39), background(49) {
+        }
+    };
+
+    /**
+     * The buffer in which a thread assembles its lines in line-buffered
+     * mode. Each complete line is published as a whole; a partial line is
+     * only published when the stream is flushed.
+     */
+    class LineBuffer : public std::streambuf {
+    public:
+        ConsoleWriter& writer;
+        std::string pending;
+        ColorState colorState;
+        bool lastWasEndLine;
+        std::ostream stream;
+
+        LineBuffer(ConsoleWriter& writer) : writer(writer), lastWasEndLine(false), stream(this) {
+        }
+
+        /**
+         * Publishes the pending complete lines, or all pending text if
+         * @c partial is set.
+         */
+        void publish(bool partial);
+
+    protected:
+        virtual int_type overflow(int_type c);
+
+        virtual std::streamsize xsputn(const char_type* s, std::streamsize n);
+
+        virtual int sync();
+    };
+
+    /**
+     * The line buffers a thread created. When the thread exits, the buffers
+     * of the writers that still exist are published and destroyed.
+     */
+    class LineOwner {
+    public:
+        struct Owned {
+            ConsoleWriter* writer;
+            unsigned long serial;
+            LineBuffer* buffer;
+        };
+
+        std::vector<Owned> owned;
+
+        ~LineOwner();
+    };
+
+    /**
+     * The writers that exist, so an exiting thread can tell whether the
+     * writer of a line buffer is still there.
+     */
+    class Registry {
+    public:
+        std::mutex mutex;
+        std::unordered_set<ConsoleWriter*> writers;
+    };
+
+    static Registry& registry();
+
+    static std::atomic<unsigned long> serials;
+
     std::ostream& out;
     int kindOfStream;
-    std::stack<Color> colorStack;
+    Terminal terminal;
+    ColorState colorState;
     bool ignoreColors;
+    bool colors;
     bool lastWasEndLine;
+    bool lineBuffered;
+    std::atomic<unsigned long> serial;
+    std::mutex outMutex;
+    std::unordered_map<std::thread::id, LineBuffer*> lines;
+    std::mutex statusMutex;
+    std::atomic<bool> statusActive;
+    bool atStatusLine;
+    std::string status;
+    std::string statusScratch;
+
+    /**
+     * Writes the specified colour, unless it does not change the attributes
+     * of the terminal.
+     */
+    void writeColor(const Color& color);
+
+    /**
+     * Returns the line buffer of the calling thread.
+     */
+    LineBuffer& line();
+
+    /**
+     * Writes the specified text to the output stream at once. For std::cout
+     * and std::cerr, this is a single write(2) to the file descriptor.
+     */
+    void publish(const char* s, size_t n);
+
+    /**
+     * Publishes the pending text of the specified line buffer and destroys
+     * it. The caller must hold outMutex.
+     */
+    void releaseLine(LineBuffer* buffer);
+
+    /**
+     * Publishes all pending text of all threads and removes their buffers.
+     * The buffers are destroyed, so no other thread may be writing.
+     */
+    void clearLines();
+
+    bool& endLine() {
+        return lineBuffered ? line().lastWasEndLine : lastWasEndLine;
+    }
 public:
 
     /**
@@ -98,25 +311,68 @@ public:
      */
     ConsoleWriter(std::ostream& out);
 
-    virtual ~ConsoleWriter() {
-
-    }
+    virtual ~ConsoleWriter();
 
     /**
-     * Returns the topmost stream on the stack stream.
+     * Returns the topmost stream on the stack stream. In line-buffered mode,
+     * this is the line of the calling thread if no stream was pushed.
      */
     virtual ostream& ss() {
-        if(sss.size() == 1) return out;
+        if(sss.size() == 1) return lineBuffered ? line().stream : out;
         return *sss.top();
     }
 
+    /**
+     * Sets whether to buffer lines. In line-buffered mode, each thread
+     * assembles its lines in a buffer of its own, and each complete line is
+     * written to the output stream at once: using a single write(2) for
+     * std::cout and std::cerr, under a lock for other streams. This keeps
+     * the lines of multiple threads and processes from interleaving. Flushing
+     * writes a partial line as well.
+     * Writing to the ConsoleWriter from multiple threads is only supported
+     * in this mode. Pushed segments, indentation and other settings are
+     * shared by all threads and should not be changed concurrently, and
+     * automatic prefixing is not supported across threads. Colours
+     * are tracked per line, so the first colour of each line is always
+     * written.
+     * Disabling line-buffered mode writes all pending text and discards the
+     * buffers of the threads, so no other thread may be writing meanwhile.
+     * @param lineBuffered Whether to buffer lines.
+     */
+    void setLineBuffered(bool lineBuffered);
+
+    bool isLineBuffered() const { return lineBuffered; }
+
+    /**
+     * Shows the specified status line below the other output, replacing the
+     * previous status line. Lines written afterwards clear the status line,
+     * are written and redraw it, so the output scrolls above it. This only
+     * has effect in line-buffered mode on a terminal. The status line is
+     * cut off at the width of the terminal.
+     * @param line The status line, or "" to remove the status line.
+     */
+    void setStatusLine(const std::string& line);
+
     /**
      * Stream a Color object. The next object streamed will be of the specified
-     * colour. Often followed by push().
+     * colour. Often followed by push(). Nothing is written if colours are
+     * disabled or the colour does not change the attributes of the terminal.
      * @param color The Color the next streamed object will have.
      * @return The Conwo
      */
-    virtual ConsoleWriter& operator<<(ConsoleWriter::Color color);
+    ConsoleWriter& operator<<(const ConsoleWriter::Color& color) {
+        if(colors) writeColor(color);
+        return *this;
+    }
+
+    /**
+     * Forgets the attributes of the terminal, so the next colour is written
+     * even if it appears to be set already. Use this after something else
+     * wrote to the terminal.
+     */
+    void forgetColorState() {
+        colorState.known = false;
+    }
 
     virtual ConsoleWriter& appendLine(const string& s) {
         preAddHook();
@@ -127,65 +383,73 @@ public:
     }
 
     virtual ConsoleWriter& append(const string& s) {
-        ss() << s;
+        if(autoPrefix) {
+            appendAutoPrefixed(s);
+        } else {
+            ss() << s;
+        }
         return *this;
     }
 
     virtual ConsoleWriter& append(int i) {
-        ss() << i;
+        writeNumber(i);
         return *this;
     }
 
     virtual ConsoleWriter& append(unsigned int i) {
-        ss() << i;
+        writeNumber(i);
         return *this;
     }
 
     virtual ConsoleWriter& operator<<(const string& s) {
         preAddHook();
-        ss() << s;
+        if(autoPrefix) {
+            appendAutoPrefixed(s);
+        } else {
+            ss() << s;
+        }
         return *this;
     }
 
     virtual ConsoleWriter& operator<<(int i) {
         preAddHook();
-        ss() << i;
+        writeNumber(i);
         return *this;
     }
 
     virtual ConsoleWriter& operator<<(unsigned int i) {
         preAddHook();
-        ss() << i;
+        writeNumber(i);
         return *this;
     }
 
     virtual ConsoleWriter& operator<<(long int i) {
         preAddHook();
-        ss() << i;
+        writeNumber(i);
         return *this;
     }
 
     virtual ConsoleWriter& operator<<(long unsigned int i) {
         preAddHook();
-        ss() << i;
+        writeNumber(i);
         return *this;
     }
 
     virtual ConsoleWriter& operator<<(float f) {
         preAddHook();
-        ss() << f;
+        writeNumber(f);
         return *this;
     }
 
     virtual ConsoleWriter& operator<<(double d) {
         preAddHook();
-        ss() << d;
+        writeNumber(d);
         return *this;
     }
 
     virtual ConsoleWriter& operator<<(long double ld) {
         preAddHook();
-        ss() << ld;
+        writeNumber(ld);
         return *this;
     }
 
@@ -197,19 +461,20 @@ public:
 
     virtual ConsoleWriter& operator<<(const FileWriter& other) {
         preAddHook();
-        ss() << other.toString();
+        other.writeTo(ss());
         return *this;
     }
 
     virtual ConsoleWriter& operator<<(std::ostream& (* f)(std::ostream&)) {
         preAddHook();
         ss() << f;
-        lastWasEndLine = true;
+        endLine() = true;
+        if(autoPrefix) atLineStart = true;
         return *this;
     }
 
     virtual ConsoleWriter& appendPrefix() {
-        append(applyprefix);
+        FileWriter::appendPrefix();
         return *this;
     }
 
@@ -218,14 +483,45 @@ public:
         return *this;
     }
 
+    /**
+     * Sets whether to leave out colours. Colours are only written if they
+     * are not ignored and the terminal supports them.
+     * @param ignoreColors Whether to leave out colours.
+     */
     virtual void setIgnoreColors(bool ignoreColors) {
         this->ignoreColors = ignoreColors;
+        colors = !ignoreColors && terminal.colors;
+    }
+
+    /**
+     * Returns whether colours are written.
+     * @return Whether colours are written.
+     */
+    bool hasColors() const { return colors; }
+
+    /**
+     * Returns the capabilities of the terminal the output stream is
+     * connected to. For streams other than std::cout and std::cerr, no
+     * terminal is assumed.
+     * @return The capabilities of the terminal.
+     */
+    const Terminal& getTerminal() const { return terminal; }
+
+    /**
+     * Overrides the detected capabilities of the terminal, e.g., to write
+     * colours to a stream other than std::cout and std::cerr.
+     * @param terminal The capabilities of the terminal.
+     */
+    void setTerminal(const Terminal& terminal) {
+        this->terminal = terminal;
+        colors = !ignoreColors && terminal.colors;
     }
 
     virtual void preAddHook() {
-        if(lastWasEndLine) {
+        bool& last = endLine();
+        if(last) {
+            last = false;
             appendPrefix();
-            lastWasEndLine = false;
         }
     }
 
@@ -0,0 +1,525 @@
+/*
+ * DataWriter.h
+ *
+ * Part of a general library.
+ *
+ * @author Freark van der Berg
+ */
+#pragma once
+
+#include <cmath>
+#include <cstdio>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+#include "libfrugi/FileWriter.h"
+#include "libfrugi/NumberFormat.h"
+#include "libfrugi/Shell.h"
+
+namespace libfrugi {
+
+/**
+ * Base class of the structured emitters. The output is written straight to
+ * the stream buffer of the topmost stream of a FileWriter, without building
+ * temporary strings. Prefixes, postfixes and indentation of the FileWriter
+ * are not applied.
+ */
+class DataWriter {
+protected:
+    FileWriter& out;
+
+    /**
+     * Writes the specified characters as they are.
+     */
+    void write(const char* s, size_t n) {
+        out.ss().rdbuf()->sputn(s, n);
+    }
+
+    void write(char c) {
+        out.ss().rdbuf()->sputc(c);
+    }
+
+    /**
+     * Writes the specified number. Integers are written in decimal, floating
+     * point numbers in the shortest form that reads back to the same value.
+     */
+    template<typename T>
+    void writeNumber(T value) {
+        char buffer[NumberFormat::CHARS_MAX];
+        char* end;
+        if constexpr(NumberFormat::isSupported<T>()) {
+            end = NumberFormat::format(buffer, value);
+        } else {
+            end = buffer + snprintf(buffer, sizeof(buffer), "%.17g", (double)value);
+        }
+        write(buffer, end - buffer);
+    }
+
+    /**
+     * Returns the first character in [s, end) that is a control character,
+     * '"' or '\\', or end if there is none.
+     */
+    static const char* findJsonSpecial(const char* s, const char* end);
+
+    /**
+     * Returns the first character in [s, end) that is one of the specified
+     * characters, or end if there is none.
+     */
+    static const char* findAnyOf(const char* s, const char* end, char a, char b, char c, char d);
+
+public:
+
+    /**
+     * Returns whether values of type T are written as numbers, which holds
+     * for arithmetic types other than bool and the character types.
+     * @return Whether values of type T are written as numbers.
+     */
+    template<typename T>
+    static constexpr bool isNumber() {
+        return std::is_arithmetic_v<T> && (std::is_floating_point_v<T> || NumberFormat::isSupported<T>());
+    }
+
+    DataWriter(FileWriter& out) : out(out) {
+    }
+
+    virtual ~DataWriter() {
+    }
+
+    FileWriter& getFileWriter() { return out; }
+};
+
+/**
+ * The JsonWriter class writes JSON to a FileWriter while the document is
+ * being produced. Objects and arrays are opened and closed with
+ * beginObject(), endObject(), beginArray() and endArray(). Inside an object,
+ * each value is preceded by key(), or written using field(). Each top-level
+ * value is followed by a newline, so a sequence of top-level values forms
+ * JSON Lines.
+ * Strings are escaped by scanning for characters that need it and copying
+ * the runs in between as a whole. Non-finite numbers are written as null.
+ */
+class JsonWriter : public DataWriter {
+private:
+    std::string scopes;
+    bool first;
+    bool afterKey;
+
+    /**
+     * Writes the separator needed before the next value.
+     */
+    void beginValue() {
+        assert(scopes.empty() || scopes.back() == '[' || afterKey);
+        if(afterKey) {
+            afterKey = false;
+        } else if(!scopes.empty() && !first) {
+            write(',');
+        }
+        first = false;
+    }
+
+    /**
+     * Finishes a value, ending the line if it was a top-level value.
+     */
+    void endValue() {
+        if(scopes.empty()) write('\n');
+    }
+
+    void writeString(std::string_view s);
+
+    JsonWriter& begin(char open);
+
+    JsonWriter& end(char open, char close);
+
+public:
+
+    JsonWriter(FileWriter& out) : DataWriter(out), first(true), afterKey(false) {
+    }
+
+    JsonWriter& beginObject() { return begin('{'); }
+
+    JsonWriter& endObject() { return end('{', '}'); }
+
+    JsonWriter& beginArray() { return begin('['); }
+
+    JsonWriter& endArray() { return end('[', ']'); }
+
+    /**
+     * Writes the key of the next value in the current object.
+     * @param name The key.
+     */
+    JsonWriter& key(std::string_view name);
+
+    JsonWriter& value(std::string_view s) {
+        beginValue();
+        writeString(s);
+        endValue();
+        return *this;
+    }
+
+    JsonWriter& value(char c) {
+        return value(std::string_view(&c, 1));
+    }
+
+    JsonWriter& value(const char* s) {
+        return s ? value(std::string_view(s)) : value(nullptr);
+    }
+
+    JsonWriter& value(bool b) {
+        beginValue();
+        if(b) {
+            write("true", 4);
+        } else {
+            write("false", 5);
+        }
+        endValue();
+        return *this;
+    }
+
+    JsonWriter& value(std::nullptr_t) {
+        beginValue();
+        write("null", 4);
+        endValue();
+        return *this;
+    }
+
+    template<typename T>
+    std::enable_if_t<isNumber<T>(), JsonWriter&> value(T number) {
+        beginValue();
+        if constexpr(std::is_floating_point_v<T>) {
+            if(!std::isfinite(number)) {
+                write("null", 4);
+                endValue();
+                return *this;
+            }
+        }
+        writeNumber(number);
+        endValue();
+        return *this;
+    }
+
+    /**
+     * Writes the statistics as an object with a field for each statistic.
+     * @param statistics The statistics to write.
+     */
+    JsonWriter& value(const Shell::RunStatistics& statistics);
+
+    /**
+     * Writes a key and a value in the current object.
+     * @param name The key.
+     * @param v The value.
+     */
+    template<typename T>
+    JsonWriter& field(std::string_view name, const T& v) {
+        key(name);
+        return value(v);
+    }
+
+    /**
+     * Returns the number of objects and arrays currently open.
+     * @return The number of open objects and arrays.
+     */
+    size_t getDepth() const { return scopes.size(); }
+};
+
+/**
+ * The CsvWriter class writes CSV rows to a FileWriter, following RFC 4180:
+ * fields containing the separator, a quote or a line break are quoted and
+ * quotes inside them are doubled. Rows are ended by a newline. Fields are
+ * scanned for characters needing quotes and written without copying them.
+ */
+class CsvWriter : public DataWriter {
+private:
+    char separator;
+    bool first;
+
+    void beginField() {
+        if(!first) write(separator);
+        first = false;
+    }
+
+    void writeString(std::string_view s);
+
+public:
+
+    /**
+     * Creates a new CsvWriter writing to the specified FileWriter.
+     * @param out The FileWriter to write to.
+     * @param separator The character separating the fields of a row.
+     */
+    CsvWriter(FileWriter& out, char separator = ',') : DataWriter(out), separator(separator), first(true) {
+    }
+
+    /**
+     * Ends the current row.
+     */
+    CsvWriter& endRow() {
+        write('\n');
+        first = true;
+        return *this;
+    }
+
+    CsvWriter& field(std::string_view s) {
+        beginField();
+        writeString(s);
+        return *this;
+    }
+
+    CsvWriter& field(char c) {
+        return field(std::string_view(&c, 1));
+    }
+
+    CsvWriter& field(const char* s) {
+        return field(std::string_view(s ? s : ""));
+    }
+
+    CsvWriter& field(bool b) {
+        beginField();
+        if(b) {
+            write("true", 4);
+        } else {
+            write("false", 5);
+        }
+        return *this;
+    }
+
+    template<typename T>
+    std::enable_if_t<isNumber<T>(), CsvWriter&> field(T number) {
+        beginField();
+        writeNumber(number);
+        return *this;
+    }
+
+    /**
+     * Writes a field for each statistic, in the order of
+     * runStatisticsHeader().
+     * @param statistics The statistics to write.
+     */
+    CsvWriter& field(const Shell::RunStatistics& statistics);
+
+    /**
+     * Writes the specified fields as a complete row.
+     * @param fields The fields of the row.
+     */
+    template<typename... Fields>
+    CsvWriter& row(const Fields& ... fields) {
+        (field(fields), ...);
+        return endRow();
+    }
+
+    /**
+     * Writes the names of the fields written by field() for statistics, to
+     * be used in the header row.
+     */
+    CsvWriter& runStatisticsHeader();
+};
+
+/**
+ * The TableWriter class writes rows as a table with aligned columns to a
+ * FileWriter, such as a ConsoleWriter, without keeping the whole table in
+ * memory. Rows are collected in blocks. When a block is full, the width of
+ * each column is widened to fit the cells in the block and the block is
+ * written. The first block thus acts as a sample from which the widths are
+ * estimated; columns only become wider afterwards, so large tables stay
+ * readable while only one block is kept at a time. The cells of a block
+ * are stored together in a single string, and numbers are formatted
+ * directly into it using NumberFormat.
+ * Columns can be declared with a title using column(), which gives a header
+ * above the first block. Cells without a declared column get a column
+ * without a title.
+ */
+class TableWriter : public DataWriter {
+public:
+
+    /**
+     * How the cells of a column are aligned. AUTO aligns the cells to the
+     * right if the first cell of the column is a number.
+     */
+    enum Alignment {
+        AUTO,
+        LEFT,
+        RIGHT
+    };
+
+    /**
+     * The default number of rows per block.
+     */
+    static const size_t BLOCK_ROWS_DEFAULT;
+
+private:
+
+    class Column {
+    public:
+        std::string title;
+        Alignment alignment;
+        size_t width;
+
+        Column(std::string_view title, Alignment alignment) : title(title), alignment(alignment),
+                                                               width(0) {
+        }
+    };
+
+    std::vector<Column> columns;
+    std::string separator;
+    size_t blockRows;
+    int precision;
+    bool headerWritten;
+    std::string cells;
+    std::vector<size_t> cellEnds;
+    std::vector<size_t> rowEnds;
+    std::vector<std::string_view> views;
+    size_t rowCells;
+
+    /**
+     * Finishes the cell written to the end of the cells and creates its
+     * column if needed.
+     */
+    void endCell(bool number) {
+        if(rowCells == columns.size()) columns.emplace_back(std::string_view(), AUTO);
+        Column& column = columns[rowCells];
+        if(column.alignment == AUTO) column.alignment = number ? RIGHT : LEFT;
+        cellEnds.push_back(cells.size());
+        ++rowCells;
+    }
+
+    /**
+     * Writes @c n spaces.
+     */
+    void pad(size_t n);
+
+    /**
+     * Writes the cells in @c views as a single row.
+     */
+    void writeRow();
+
+public:
+
+    /**
+     * Creates a new TableWriter writing to the specified FileWriter.
+     * @param out The FileWriter to write to.
+     * @param blockRows The number of rows collected before they are written.
+     * @param separator The text written between the columns.
+     */
+    TableWriter(FileWriter& out, size_t blockRows = BLOCK_ROWS_DEFAULT, std::string_view separator = "  ")
+            : DataWriter(out), separator(separator), blockRows(blockRows ? blockRows : 1), precision(-1),
+              headerWritten(false), rowCells(0) {
+    }
+
+    /**
+     * Writes the rows that are still collected.
+     */
+    virtual ~TableWriter() {
+        flush();
+    }
+
+    /**
+     * Declares the next column. Columns should be declared before the first
+     * row is written.
+     * @param title The title of the column in the header.
+     * @param alignment How the cells of the column are aligned.
+     */
+    TableWriter& column(std::string_view title, Alignment alignment = AUTO) {
+        columns.emplace_back(title, alignment);
+        return *this;
+    }
+
+    /**
+     * Sets the number of digits after the decimal point of floating point
+     * numbers, or -1 to write them in the shortest form that reads back to
+     * the same value, which is the default.
+     * @param precision The number of digits after the decimal point.
+     */
+    TableWriter& setPrecision(int precision) {
+        this->precision = precision;
+        return *this;
+    }
+
+    /**
+     * Ends the current row. If the block is full, it is written.
+     */
+    TableWriter& endRow() {
+        rowEnds.push_back(cellEnds.size());
+        rowCells = 0;
+        if(rowEnds.size() >= blockRows) flush();
+        return *this;
+    }
+
+    TableWriter& field(std::string_view s) {
+        cells.append(s.data(), s.size());
+        endCell(false);
+        return *this;
+    }
+
+    TableWriter& field(char c) {
+        return field(std::string_view(&c, 1));
+    }
+
+    TableWriter& field(const char* s) {
+        return field(std::string_view(s ? s : ""));
+    }
+
+    TableWriter& field(bool b) {
+        return field(b ? std::string_view("true") : std::string_view("false"));
+    }
+
+    template<typename T>
+    std::enable_if_t<isNumber<T>(), TableWriter&> field(T number) {
+        size_t size = cells.size();
+        cells.resize(size + NumberFormat::CHARS_MAX);
+        char* first = &cells[size];
+        char* end;
+        if constexpr(std::is_floating_point_v<T>) {
+            if(precision >= 0) {
+                end = NumberFormat::format(first, number, precision);
+            } else if constexpr(NumberFormat::isSupported<T>()) {
+                end = NumberFormat::format(first, number);
+            } else {
+                end = first + snprintf(first, NumberFormat::CHARS_MAX, "%.17g", (double)number);
+            }
+        } else {
+            end = NumberFormat::format(first, number);
+        }
+        cells.resize(end - cells.data());
+        endCell(true);
+        return *this;
+    }
+
+    /**
+     * Writes a cell for each statistic, in the order of
+     * runStatisticsColumns().
+     * @param statistics The statistics to write.
+     */
+    TableWriter& field(const Shell::RunStatistics& statistics);
+
+    /**
+     * Writes the specified cells as a complete row.
+     * @param fields The cells of the row.
+     */
+    template<typename... Fields>
+    TableWriter& row(const Fields& ... fields) {
+        (field(fields), ...);
+        return endRow();
+    }
+
+    /**
+     * Declares a column for each statistic written by field() for
+     * statistics.
+     */
+    TableWriter& runStatisticsColumns();
+
+    /**
+     * Writes the rows collected so far, widening the columns to fit them.
+     * A row that is not ended yet is kept.
+     */
+    TableWriter& flush();
+
+    /**
+     * Returns the current width of the specified column.
+     * @param index The index of the column.
+     * @return The width of the column in characters.
+     */
+    size_t getWidth(size_t index) const { return index < columns.size() ? columns[index].width : 0; }
+};
+
+} // namespace libfrugi
@@ -10,36 +10,202 @@
 #include <sstream>
 #include <stack>
 #include <string>
+#include <vector>
 #include <assert.h>
+#include <string.h>
+
+#include "libfrugi/CompressingSink.h"
+#include "libfrugi/Format.h"
+#include "libfrugi/NumberFormat.h"
+#include "libfrugi/OutputSink.h"
+#include "libfrugi/SegmentBuffer.h"
 
 using namespace std;
 
 namespace libfrugi {
 
 /**
- * The StringWriter class acts as a buffer to write to. It uses a stringstream
+ * The StringWriter class acts as a buffer to write to. It uses a SegmentStream
  * to write to. The added feature is automatic indentation.
- * It uses a stack of stringstream objects. Stream and append operations are
+ * It uses a stack of SegmentStream objects. Stream and append operations are
  * performed on the topmost stream. This can be used to for example outline
  * a string comprised of multiple append operations, by doing push, outline,
- * append, append, ..., pop.
+ * append, append, ..., pop. Popping a stream moves its contents to the stream
+ * below it without copying them.
  */
 class FileWriter {
+    friend class ParallelFileWriter;
 protected:
 
     int indentation;
     string prefixIndent;
     string prefix;
     string postfix;
-    std::stack<stringstream*> sss;
+    std::vector<string> prefixes;
+    std::stack<SegmentStream*> sss;
+    std::vector<SegmentStream*> pool;
+    size_t allocatedSegments;
+    SegmentStream* bottom;
+    OutputSink* sink;
+    string formatScratch;
+    bool autoPrefix;
+    bool atLineStart;
 
+    /**
+     * Whether the first line is still to be started. For a shard of a
+     * ParallelFileWriter, whether that line needs a prefix depends on where
+     * the previous shard ends, so startLine() leaves a hole for it.
+     */
+    bool firstLinePending;
+    SegmentBuffer::Hole firstPrefix;
+    string firstPrefixText;
+
+    /**
+     * Rebuilds the table of prefixes, one for each level of indentation.
+     * The table only grows afterwards, so indent() and outdent() do not
+     * build strings once a level has been used before.
+     */
     void update() {
-        applyprefix = prefix;
-        for(int i = indentation; i--;) {
-            applyprefix = prefixIndent + applyprefix;
+        prefixes.clear();
+        prefixes.push_back(prefix);
+        while(prefixes.size() <= (size_t)indentation) {
+            prefixes.push_back(prefixIndent + prefixes.back());
+        }
+    }
+
+    /**
+     * Writes the specified number to the topmost stream, bypassing the
+     * locale-dependent formatting of ostream. If the stream has non-default
+     * formatting settings, such as a width set by outlineLeftNext(), the
+     * number is streamed normally.
+     * @param value The number to write.
+     */
+    template<typename T>
+    void writeNumber(T value) {
+        if(autoPrefix) startLine();
+        ostream& out = ss();
+        if constexpr(NumberFormat::isSupported<T>()) {
+            if(NumberFormat::isDefault(out)) {
+                if(&out == sss.top()) {
+                    SegmentBuffer& buffer = sss.top()->buffer();
+                    buffer.commit(NumberFormat::format(buffer.reserve(NumberFormat::CHARS_MAX), value));
+                } else {
+                    char chars[NumberFormat::CHARS_MAX];
+                    out.write(chars, NumberFormat::format(chars, value) - chars);
+                }
+                return;
+            }
+        }
+        out << value;
+    }
+
+    /**
+     * Appends the specified string with auto prefixing. A string without
+     * newlines is streamed normally, so stream width settings still apply.
+     */
+    void appendAutoPrefixed(const string& s) {
+        if(s.empty()) return;
+        if(!memchr(s.data(), '\n', s.size())) {
+            startLine();
+            ss() << s;
+        } else {
+            writePrefixed(s.data(), s.size());
+        }
+    }
+
+    /**
+     * Writes the prefix if nothing was written yet on the current line.
+     * Only used when auto prefixing is enabled.
+     */
+    void startLine() {
+        if(atLineStart) {
+            atLineStart = false;
+            const string& prefix = getApplyPrefix();
+            if(firstLinePending) {
+                firstLinePending = false;
+                firstPrefixText = prefix;
+                firstPrefix = sss.top()->buffer().reserveHole();
+                return;
+            }
+            ss().write(prefix.data(), prefix.size());
+        }
+    }
+
+    /**
+     * Writes the specified text to the topmost stream, inserting the prefix
+     * at the start of every line. The text is scanned for newlines using
+     * memchr(), so the lines are copied in bulk. The prefix of a line is
+     * written when its first character is, so text ending in a newline does
+     * not leave a dangling prefix.
+     * @param s The text to write.
+     * @param n The length of the text.
+     */
+    void writePrefixed(const char* s, size_t n) {
+        ostream& out = ss();
+        const char* end = s + n;
+        while(s < end) {
+            startLine();
+            const char* newline = static_cast<const char*>(memchr(s, '\n', end - s));
+            if(!newline) {
+                out.write(s, end - s);
+                return;
+            }
+            ++newline;
+            out.write(s, newline - s);
+            s = newline;
+            atLineStart = true;
+        }
+    }
+
+#if LIBFRUGI_HAVE_FORMAT_STRING
+
+    /**
+     * Writes the formatted arguments to the topmost stream, optionally as a
+     * line with prefix and postfix.
+     */
+    template<FormatString F, typename... Args>
+    void writeFormatted(bool line, const Args& ... args) {
+        using Compiled = CompiledFormat<F>;
+        size_t n = Compiled::maxSize(args...);
+        if(autoPrefix) {
+            formatScratch.resize(n);
+            char* end = Compiled::write(formatScratch.data(), args...);
+            if(line) startLine();
+            writePrefixed(formatScratch.data(), end - formatScratch.data());
+            if(line) writePrefixed(postfix.data(), postfix.size());
+            return;
+        }
+        if(line) {
+            n += getApplyPrefix().size() + postfix.size();
+        }
+        ostream& out = ss();
+        char* first;
+        if(&out == sss.top()) {
+            first = sss.top()->buffer().reserve(n);
+        } else {
+            formatScratch.resize(n);
+            first = formatScratch.data();
+        }
+        char* p = first;
+        if(line) {
+            const string& applyprefix = getApplyPrefix();
+            memcpy(p, applyprefix.data(), applyprefix.size());
+            p += applyprefix.size();
+        }
+        p = Compiled::write(p, args...);
+        if(line) {
+            memcpy(p, postfix.data(), postfix.size());
+            p += postfix.size();
+        }
+        if(&out == sss.top()) {
+            sss.top()->buffer().commit(p);
+        } else {
+            out.write(first, p - first);
         }
     }
 
+#endif
+
 public:
 
     /**
@@ -61,7 +227,12 @@ public:
     static const FileWriterOption _pop;
     static const FileWriterOption _push;
 
-    string applyprefix;
+    /**
+     * The default number of bytes after which a streaming FileWriter writes
+     * its bottom segment to its sink.
+     */
+    static const size_t HIGH_WATER_MARK_DEFAULT;
+
     string applypostfix;
 
     /**
@@ -69,20 +240,27 @@ public:
      * @param indentation Start with this level of indentation. Default is 0.
      * @param prefix The prefix to prepend to every line. Default is ""
      * @param postfix The postfix to append a single time to every line. Default is "\n"
-     * @param prefixIndent The prefix to prepend <indentlevel> times to every line. Default is "\t"
+     * @param prefixIndent The prefix to prepend <indentlevel> times to every line. Default is "", as the
+     *                     argument used to be ignored; pass "\t" or use setPrefixIndent() to indent.
      */
     FileWriter(int indentation = 0, std::string prefix = "", std::string postfix = "\n",
-               std::string prefixIndent = "\t") : indentation(indentation), prefix(prefix), postfix(postfix),
-                                                  applyprefix(""), applypostfix(postfix) {
-        sss.push(new stringstream());
+               std::string prefixIndent = "") : indentation(indentation), prefixIndent(prefixIndent), prefix(prefix),
+                                                  postfix(postfix), allocatedSegments(0), sink(nullptr), autoPrefix(false),
+                                                  atLineStart(true), firstLinePending(false), applypostfix(postfix) {
+        bottom = new SegmentStream();
+        sss.push(bottom);
         update();
     }
 
     virtual ~FileWriter() {
+        close();
         while(sss.size() > 0) {
             delete sss.top();
             sss.pop();
         }
+        for(SegmentStream* s: pool) {
+            delete s;
+        }
     }
 
     void setPostfix(const string& postfix) { this->postfix = postfix; }
@@ -104,44 +282,193 @@ public:
     const string& getPrefixIndent() const { return prefixIndent; }
 
     /**
-     * Pushed a new stringstream object on the stream stack.
+     * Returns the prefix for the current indentation level, i.e., the
+     * indentation prefix repeated for each level followed by the prefix.
+     * @return The prefix for the current indentation level.
+     */
+    const string& getApplyPrefix() const { return prefixes[indentation]; }
+
+    /**
+     * Returns the prefix for the current indentation level. This replaces
+     * the former public applyprefix member.
+     * @return The prefix for the current indentation level.
+     */
+    [[deprecated("use getApplyPrefix()")]]
+    const string& applyprefix() const { return getApplyPrefix(); }
+
+    int getIndentation() const { return indentation; }
+
+    /**
+     * Sets whether to prefix every line automatically. When enabled, all
+     * text appended or streamed to this FileWriter is scanned for newlines
+     * and the prefix for the current indentation level is inserted at the
+     * start of each line, including lines inside multi-line strings. Then
+     * appendPrefix() only writes the prefix if it was not yet written on the
+     * current line. Text written directly to ss() is not prefixed. Stream
+     * width settings do not apply to text containing newlines.
+     * @param autoPrefix Whether to prefix every line automatically.
+     */
+    void setAutoPrefix(bool autoPrefix) {
+        this->autoPrefix = autoPrefix;
+    }
+
+    bool isAutoPrefix() const { return autoPrefix; }
+
+    /**
+     * Lets this FileWriter stream its output to the specified sink. Whenever
+     * the bottom segment grows beyond the high-water mark, its contents are
+     * written to the sink, keeping memory use bounded. Pushed segments stay
+     * in memory until they are popped. The FileWriter takes ownership of the
+     * sink. A previously set sink is closed first.
+     * After this, toString() only returns the contents not yet written.
+     * @param sink The sink to write to.
+     * @param highWaterMark The number of bytes after which to write.
+     * @return 0 on success, an errno value of closing the previous sink otherwise.
+     */
+    int setSink(OutputSink* sink, size_t highWaterMark = HIGH_WATER_MARK_DEFAULT) {
+        int result = close();
+        this->sink = sink;
+        bottom->buffer().setSink(sink, highWaterMark);
+        return result;
+    }
+
+    OutputSink* getSink() const { return sink; }
+
+    /**
+     * Lets this FileWriter stream its output to the specified file, which
+     * is created or truncated.
+     * @param path The path of the file to write to.
+     * @param highWaterMark The number of bytes after which to write.
+     * @return 0 on success, an errno value otherwise.
+     */
+    int open(const string& path, size_t highWaterMark = HIGH_WATER_MARK_DEFAULT);
+
+    /**
+     * Lets this FileWriter stream its output to the specified file
+     * descriptor. The file descriptor is not closed by close().
+     * @param fd The file descriptor to write to.
+     * @param highWaterMark The number of bytes after which to write.
+     * @return 0 on success, an errno value otherwise.
+     */
+    int open(int fd, size_t highWaterMark = HIGH_WATER_MARK_DEFAULT);
+
+    /**
+     * Lets this FileWriter stream its output to the specified file, but only
+     * write the file if the output differs from its current contents. If the
+     * output is the same, the file and its modification time are left
+     * untouched. Otherwise, the file is replaced on close().
+     * @param path The path of the file to write to.
+     * @param highWaterMark The number of bytes after which to write.
+     * @return 0 on success, an errno value otherwise.
+     */
+    int openIfChanged(const string& path, size_t highWaterMark = HIGH_WATER_MARK_DEFAULT);
+
+    /**
+     * Lets this FileWriter stream its output to the specified file using a
+     * memory mapping, which is created or truncated.
+     * @param path The path of the file to write to.
+     * @param highWaterMark The number of bytes after which to write.
+     * @return 0 on success, an errno value otherwise.
+     */
+    int openMapped(const string& path, size_t highWaterMark = HIGH_WATER_MARK_DEFAULT);
+
+    /**
+     * Lets this FileWriter stream its output compressed to the specified
+     * file, which is created or truncated. Compression and writing run on a
+     * helper thread, overlapping with the formatting of further output.
+     * @param path The path of the file to write to.
+     * @param format The compression format to use.
+     * @param highWaterMark The number of bytes after which to compress.
+     * @return 0 on success, ENOTSUP if the format is not available, or an
+     *         errno value otherwise.
+     */
+    int openCompressed(const string& path, CompressingSink::Format format,
+                       size_t highWaterMark = HIGH_WATER_MARK_DEFAULT);
+
+    /**
+     * Writes the contents of the bottom segment to the sink and makes sure
+     * they are stored durably. After a crash, the output file contains at
+     * least everything written before the last checkpoint. Pushed segments
+     * are not written. Does nothing if no sink is set.
+     * @return 0 on success, an errno value otherwise.
+     */
+    int checkpoint();
+
+    /**
+     * Writes the contents of the bottom segment to the sink. Pushed segments
+     * are not written. Does nothing if no sink is set.
+     * @return 0 on success, an errno value otherwise.
+     */
+    int flush();
+
+    /**
+     * Pops all pushed segments, writes everything to the sink and closes
+     * it. Holes that are still open are written as if they were filled with
+     * nothing. Does nothing if no sink is set.
+     * @return 0 on success, an errno value otherwise.
+     */
+    int close();
+
+    /**
+     * Pushed a new SegmentStream object on the stream stack.
      * Following stream and append operations will be performed on
-     * the new stringstream object.
+     * the new SegmentStream object. SegmentStream objects that were popped
+     * before are reused, so once the deepest nesting has been reached,
+     * pushing does not allocate.
      */
     void push() {
-        sss.push(new stringstream());
+        if(pool.empty()) {
+            ++allocatedSegments;
+            sss.push(new SegmentStream());
+        } else {
+            sss.push(pool.back());
+            pool.pop_back();
+        }
     }
 
     /**
-     * Appends the contents of the topmost stringstream to the second
-     * stringstream and pops the topmost stringstream from the stream stack.
+     * Returns the number of SegmentStream objects allocated by push(). Reused
+     * objects are not counted.
+     * @return The number of allocated SegmentStream objects.
+     */
+    size_t getAllocatedSegments() const { return allocatedSegments; }
+
+    /**
+     * Appends the contents of the topmost SegmentStream to the second
+     * SegmentStream and pops the topmost SegmentStream from the stream stack.
+     * The contents are moved, not copied.
      * Following stream and append operations will be performed on
-     * the now topmost stringstream object.
-     * If there is only one stringstream object on the stack, nothing is done.
+     * the now topmost SegmentStream object.
+     * If there is only one SegmentStream object on the stack, nothing is done.
      */
     void pop() {
         if(sss.size() > 1) {
-            std::string s;
-            s = sss.top()->str();
-            delete sss.top();
+            SegmentStream* top = sss.top();
             sss.pop();
-            ss() << s;
+            ostream& out = ss();
+            if(&out == sss.top()) {
+                sss.top()->buffer().splice(top->buffer());
+            } else {
+                top->buffer().writeTo(out);
+            }
+            top->reset();
+            pool.push_back(top);
         }
     }
 
     /**
-     * Returns the topmost stringstream object.
-     * @return The topmost stringstream object.
+     * Returns the topmost stream object.
+     * @return The topmost stream object.
      */
     virtual ostream& ss() {
         return *sss.top();
     }
 
     /**
-     * Returns the topmost stringstream object.
-     * @return The topmost stringstream object.
+     * Returns the topmost SegmentStream object.
+     * @return The topmost SegmentStream object.
      */
-    stringstream& getStringStream() {
+    SegmentStream& getStringStream() {
         return *sss.top();
     }
 
@@ -164,7 +491,11 @@ public:
      * @param s The String to add.
      */
     virtual FileWriter& append(const string& s) {
-        ss() << s;
+        if(autoPrefix) {
+            appendAutoPrefixed(s);
+        } else {
+            ss() << s;
+        }
         return *this;
     }
 
@@ -174,7 +505,7 @@ public:
      * @param s The String to add.
      */
     virtual FileWriter& append(int i) {
-        ss() << i;
+        writeNumber(i);
         return *this;
     }
 
@@ -184,7 +515,7 @@ public:
      * @param s The String to add.
      */
     virtual FileWriter& append(unsigned int i) {
-        ss() << i;
+        writeNumber(i);
         return *this;
     }
 
@@ -194,7 +525,11 @@ public:
      * @param s The String to add.
      */
     virtual FileWriter& operator<<(const string& s) {
-        ss() << s;
+        if(autoPrefix) {
+            appendAutoPrefixed(s);
+        } else {
+            ss() << s;
+        }
         return *this;
     }
 
@@ -204,7 +539,7 @@ public:
      * @param i The integer to add.
      */
     virtual FileWriter& operator<<(int i) {
-        ss() << i;
+        writeNumber(i);
         return *this;
     }
 
@@ -214,7 +549,7 @@ public:
      * @param i The integer to add.
      */
     virtual FileWriter& operator<<(unsigned int i) {
-        ss() << i;
+        writeNumber(i);
         return *this;
     }
 
@@ -224,7 +559,7 @@ public:
      * @param i The integer to add.
      */
     virtual FileWriter& operator<<(long int i) {
-        ss() << i;
+        writeNumber(i);
         return *this;
     }
 
@@ -234,7 +569,7 @@ public:
      * @param i The integer to add.
      */
     virtual FileWriter& operator<<(long unsigned int i) {
-        ss() << i;
+        writeNumber(i);
         return *this;
     }
 
@@ -244,7 +579,7 @@ public:
      * @param f The float to add.
      */
     virtual FileWriter& operator<<(float f) {
-        ss() << f;
+        writeNumber(f);
         return *this;
     }
 
@@ -254,7 +589,7 @@ public:
      * @param d The double to add.
      */
     virtual FileWriter& operator<<(double d) {
-        ss() << d;
+        writeNumber(d);
         return *this;
     }
 
@@ -264,7 +599,7 @@ public:
      * @param ld The double to add.
      */
     virtual FileWriter& operator<<(long double ld) {
-        ss() << ld;
+        writeNumber(ld);
         return *this;
     }
 
@@ -291,7 +626,11 @@ public:
      * @param other The FileWriter to stream the contents of.
      */
     virtual FileWriter& operator<<(const FileWriter& other) {
-        ss() << other.toString();
+        if(autoPrefix) {
+            other.sss.top()->buffer().forEach([this](const char* s, size_t n) { writePrefixed(s, n); });
+        } else {
+            other.writeTo(ss());
+        }
         return *this;
     }
 
@@ -305,7 +644,11 @@ public:
      * indentation level.
      */
     virtual FileWriter& appendPrefix() {
-        append(applyprefix);
+        if(autoPrefix) {
+            startLine();
+        } else {
+            append(getApplyPrefix());
+        }
         return *this;
     }
 
@@ -318,13 +661,56 @@ public:
         return *this;
     }
 
+    /**
+     * Called before something is added to the stream by format() and
+     * formatLine(). Does nothing by default.
+     */
+    virtual void preAddHook() {
+    }
+
+#if LIBFRUGI_HAVE_FORMAT_STRING
+
+    /**
+     * Add the arguments to the stream, formatted according to the format
+     * string F, e.g. format<"{} = {};">(name, value). Each "{}" is replaced
+     * by the next argument. The format string is parsed at compile time and
+     * the result is written with a single reservation of buffer space.
+     * Stream formatting settings, such as those of outlineLeftNext(), do not
+     * apply. Nothing will be prefixed or postfixed.
+     * @param args The arguments to format.
+     */
+    template<FormatString F, typename... Args>
+    FileWriter& format(const Args& ... args) {
+        preAddHook();
+        writeFormatted<F>(false, args...);
+        return *this;
+    }
+
+    /**
+     * Add the arguments to the stream, formatted according to the format
+     * string F, as a line. The line will be prefixed based on the currently
+     * set prefix and indentation level. The currently set postfix will be
+     * appended.
+     * @param args The arguments to format.
+     */
+    template<FormatString F, typename... Args>
+    FileWriter& formatLine(const Args& ... args) {
+        preAddHook();
+        writeFormatted<F>(true, args...);
+        return *this;
+    }
+
+#endif
+
     /**
      * Increase the indentation. Subsequently affected method calls will be
      * prefixed with an additional prefix.
      */
     void indent() {
         ++indentation;
-        applyprefix = prefixIndent + applyprefix;
+        if((size_t)indentation == prefixes.size()) {
+            prefixes.push_back(prefixIndent + prefixes.back());
+        }
     }
 
     /**
@@ -334,7 +720,7 @@ public:
      */
     void outdent() {
         assert(indentation > 0);
-        applyprefix = applyprefix.substr(prefixIndent.length());
+        --indentation;
     }
 
     /**
@@ -365,6 +751,57 @@ public:
         ss() << right;
     }
 
+    /**
+     * Moves the contents of the other FileWriter to the end of this one,
+     * without copying them if possible. Segments pushed on the other
+     * FileWriter are popped first. Afterwards, the other FileWriter is empty.
+     * Nothing will be prefixed or postfixed.
+     * @param other The FileWriter to move the contents of.
+     */
+    FileWriter& splice(FileWriter& other) {
+        if(&other == this) return *this;
+        while(other.sss.size() > 1) {
+            other.pop();
+        }
+        ostream& out = ss();
+        if(&out == sss.top()) {
+            sss.top()->buffer().splice(other.bottom->buffer());
+        } else {
+            other.bottom->buffer().writeTo(out);
+            other.bottom->buffer().clear();
+        }
+        return *this;
+    }
+
+    typedef SegmentBuffer::Hole Hole;
+
+    /**
+     * Reserves a hole at the current position in the topmost segment, to be
+     * filled later using fill(), e.g., with a count or size that is only
+     * known after the text following it is written. The hole moves along
+     * when its segment is popped or spliced. The contents after an open hole
+     * are not written to the sink before the hole is filled, except by
+     * close(). A hole in a segment that is popped onto a stream other than a
+     * segment is written as if it were empty.
+     * @return The reserved hole.
+     */
+    Hole reserveHole() {
+        return sss.top()->buffer().reserveHole();
+    }
+
+    /**
+     * Fills the specified hole with the specified text. Nothing will be
+     * prefixed or postfixed. Does nothing if the hole is not open, e.g.,
+     * because its segment was cleared or popped onto a stream other than a
+     * segment.
+     * @param hole The hole to fill.
+     * @param text The text to fill the hole with.
+     */
+    FileWriter& fill(Hole& hole, const string& text) {
+        SegmentBuffer::fill(hole, text.data(), text.size());
+        return *this;
+    }
+
     /**
      * Returns the current contents of the buffer.
      * @return The current contents of the buffer.
@@ -374,19 +811,29 @@ public:
     }
 
     /**
-     * Clears the topmost stringstream, setting it to "".
+     * Writes the current contents of the buffer to the specified stream,
+     * without first making a copy of them.
+     * @param out The stream to write to.
+     */
+    void writeTo(ostream& out) const {
+        sss.top()->buffer().writeTo(out);
+    }
+
+    /**
+     * Clears the topmost SegmentStream, setting it to "".
      */
     void clear() {
-        sss.top()->str("");
+        sss.top()->buffer().clear();
     }
 
     /**
-     * Clears all the stringstream object in the stream stack,
+     * Clears all the SegmentStream object in the stream stack,
      * setting all to "".
      */
     void clearAll() {
         while(sss.size() > 1) {
-            delete sss.top();
+            sss.top()->reset();
+            pool.push_back(sss.top());
             sss.pop();
         }
         clear();
@@ -0,0 +1,212 @@
+/*
+ * Format.h
+ *
+ * Part of a general library.
+ *
+ * @author Freark van der Berg
+ */
+#pragma once
+
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+#include "libfrugi/NumberFormat.h"
+
+/**
+ * Format strings as template arguments need class types as non-type
+ * template parameters, which is a C++20 feature.
+ */
+#if defined(__cpp_nontype_template_args) && __cpp_nontype_template_args >= 201911L
+#   define LIBFRUGI_HAVE_FORMAT_STRING 1
+#else
+#   define LIBFRUGI_HAVE_FORMAT_STRING 0
+#endif
+
+namespace libfrugi {
+
+/**
+ * Describes how an argument of type T is written by a compiled format.
+ * maxSize() returns an upper bound of the number of characters written and
+ * write() writes the argument and returns the end of the written characters.
+ */
+template<typename T, typename Enable = void>
+class FormatArgument {
+    static_assert(sizeof(T) == 0, "type not supported as format argument");
+};
+
+template<typename T>
+class FormatArgument<T, std::enable_if_t<NumberFormat::isSupported<T>()>> {
+public:
+    static size_t maxSize(T) { return NumberFormat::CHARS_MAX; }
+
+    static char* write(char* p, T value) { return NumberFormat::format(p, value); }
+};
+
+template<>
+class FormatArgument<char> {
+public:
+    static size_t maxSize(char) { return 1; }
+
+    static char* write(char* p, char c) {
+        *p = c;
+        return p + 1;
+    }
+};
+
+template<>
+class FormatArgument<std::string_view> {
+public:
+    static size_t maxSize(std::string_view s) { return s.size(); }
+
+    static char* write(char* p, std::string_view s) {
+        memcpy(p, s.data(), s.size());
+        return p + s.size();
+    }
+};
+
+template<>
+class FormatArgument<std::string> : public FormatArgument<std::string_view> {
+};
+
+template<>
+class FormatArgument<const char*> : public FormatArgument<std::string_view> {
+};
+
+template<>
+class FormatArgument<char*> : public FormatArgument<std::string_view> {
+};
+
+template<size_t N>
+class FormatArgument<char[N]> : public FormatArgument<std::string_view> {
+};
+
+#if LIBFRUGI_HAVE_FORMAT_STRING
+
+/**
+ * A format string usable as a template argument. Each "{}" is replaced by
+ * the next argument, "{{" and "}}" write a single brace. Any other use of
+ * braces is rejected at compile time.
+ */
+template<size_t N>
+class FormatString {
+public:
+    char chars[N];
+
+    constexpr FormatString(const char (& s)[N]) : chars{} {
+        for(size_t i = 0; i < N; ++i) {
+            chars[i] = s[i];
+        }
+    }
+
+    /**
+     * Returns the number of "{}" placeholders.
+     * @return The number of placeholders.
+     */
+    constexpr size_t countArguments() const {
+        size_t n = 0;
+        for(size_t i = 0; i + 1 < N; ++i) {
+            if(chars[i] == '{') {
+                if(i + 2 < N && chars[i + 1] == '{') {
+                    ++i;
+                } else if(i + 2 < N && chars[i + 1] == '}') {
+                    ++n;
+                    ++i;
+                } else {
+                    throw "format string contains a '{' that is not part of \"{}\" or \"{{\"";
+                }
+            } else if(chars[i] == '}') {
+                if(i + 2 < N && chars[i + 1] == '}') {
+                    ++i;
+                } else {
+                    throw "format string contains a '}' that is not part of \"{}\" or \"}}\"";
+                }
+            }
+        }
+        return n;
+    }
+};
+
+/**
+ * The result of parsing a FormatString at compile time: the literal text
+ * with escaped braces resolved, split into one piece before each argument
+ * and a final piece after the last argument.
+ */
+template<FormatString F>
+class CompiledFormat {
+public:
+    static constexpr size_t ARGUMENTS = F.countArguments();
+
+    class Layout {
+    public:
+        char literal[sizeof(F.chars)];
+        size_t start[ARGUMENTS + 2];
+        size_t size;
+    };
+
+    static constexpr Layout compile() {
+        Layout layout{};
+        size_t piece = 0;
+        size_t n = 0;
+        layout.start[0] = 0;
+        for(size_t i = 0; i + 1 < sizeof(F.chars); ++i) {
+            char c = F.chars[i];
+            if(c == '{' && F.chars[i + 1] == '}') {
+                layout.start[++piece] = n;
+                ++i;
+                continue;
+            }
+            if((c == '{' || c == '}') && F.chars[i + 1] == c) {
+                ++i;
+            }
+            layout.literal[n++] = c;
+        }
+        layout.start[ARGUMENTS + 1] = n;
+        layout.size = n;
+        return layout;
+    }
+
+    static constexpr Layout layout = compile();
+
+    /**
+     * Returns an upper bound of the number of characters written by write().
+     */
+    template<typename... Args>
+    static size_t maxSize(const Args& ... args) {
+        return layout.size + (size_t(0) + ... + FormatArgument<std::decay_t<Args>>::maxSize(args));
+    }
+
+    /**
+     * Writes the formatted text to @c p, which needs room for maxSize()
+     * characters.
+     * @return The end of the written characters.
+     */
+    template<typename... Args>
+    static char* write(char* p, const Args& ... args) {
+        static_assert(sizeof...(Args) == ARGUMENTS, "number of arguments does not match the format string");
+        return write(p, std::index_sequence_for<Args...>(), args...);
+    }
+
+private:
+    template<size_t I>
+    static char* writeLiteral(char* p) {
+        constexpr size_t length = layout.start[I + 1] - layout.start[I];
+        if constexpr(length > 0) {
+            memcpy(p, layout.literal + layout.start[I], length);
+        }
+        return p + length;
+    }
+
+    template<size_t... I, typename... Args>
+    static char* write(char* p, std::index_sequence<I...>, const Args& ... args) {
+        ((p = writeLiteral<I>(p), p = FormatArgument<std::decay_t<Args>>::write(p, args)), ...);
+        return writeLiteral<ARGUMENTS>(p);
+    }
+};
+
+#endif
+
+} // namespace libfrugi
@@ -0,0 +1,189 @@
+/*
+ * LogQueue.h
+ *
+ * Part of a general library.
+ *
+ * @author Freark van der Berg
+ */
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "libfrugi/ConsoleWriter.h"
+
+namespace libfrugi {
+
+/**
+ * A bounded queue of rendered log records, written to a ConsoleWriter by a
+ * background thread. Any number of threads can push records at the same
+ * time without taking a lock: each push claims a slot of a ring buffer with
+ * a single compare-and-swap, so threads producing log output do not wait
+ * for each other or for the terminal. A single consumer thread writes the
+ * records in the order their slots were claimed and flushes the
+ * ConsoleWriter whenever the queue runs empty.
+ * Only the consumer thread writes to the ConsoleWriter; other threads
+ * should not write to it directly while the queue exists, unless it is in
+ * line-buffered mode.
+ * For example, to let worker threads report through a MessageFormatter:
+ *   LogQueue queue(formatter.getConsoleWriter());
+ *   formatter.setQueue(&queue);
+ */
+class LogQueue {
+public:
+
+    /**
+     * What push() does when the queue is full.
+     */
+    enum OverflowPolicy {
+
+        /**
+         * Wait until the consumer made room, so no record is lost.
+         */
+        BLOCK,
+
+        /**
+         * Discard the record.
+         */
+        DROP,
+
+        /**
+         * Discard the record and let the consumer write a line with the
+         * number of discarded records once there is room again.
+         */
+        COUNT
+    };
+
+    /**
+     * The default number of records the queue can hold.
+     */
+    static const size_t CAPACITY_DEFAULT;
+
+private:
+
+    /**
+     * A slot of the ring buffer. The sequence number tells whose turn it is:
+     * equal to the position of the slot, it is free for the producer
+     * claiming that position; one more, it holds a record for the consumer.
+     */
+    class alignas(64) Slot {
+    public:
+        std::atomic<size_t> sequence;
+        std::string record;
+    };
+
+    ConsoleWriter& writer;
+    OverflowPolicy policy;
+    Slot* slots;
+    size_t mask;
+    alignas(64) std::atomic<size_t> enqueuePos;
+    alignas(64) std::atomic<size_t> dequeuePos;
+    std::atomic<size_t> dropped;
+    std::atomic<size_t> stalls;
+    std::atomic<bool> sleeping;
+    std::atomic<bool> stopping;
+    size_t reportedDropped;
+    std::string scratch;
+    std::mutex mutex;
+    std::condition_variable workAvailable;
+    std::thread thread;
+
+    /**
+     * Claims a slot and swaps the record into it.
+     * @return Whether there was room.
+     */
+    bool tryPush(std::string& record);
+
+    /**
+     * Writes all records that are ready.
+     * @return The number of records written.
+     */
+    size_t consume();
+
+    /**
+     * Wakes the consumer if it is waiting for records. The sequence number
+     * of the slot is stored before with sequential consistency, so either
+     * the consumer sees the record or we see it is sleeping. Only the
+     * producer that clears the sleeping flag takes the lock to notify it,
+     * so other producers never wait for each other.
+     */
+    void wake() {
+        if(sleeping.load(std::memory_order_seq_cst) && sleeping.exchange(false, std::memory_order_seq_cst)) {
+            std::lock_guard<std::mutex> lock(mutex);
+            workAvailable.notify_one();
+        }
+    }
+
+    void run();
+
+public:
+
+    /**
+     * Creates a new LogQueue writing to the specified ConsoleWriter and
+     * starts the consumer thread.
+     * @param writer The ConsoleWriter to write the records to.
+     * @param capacity The number of records the queue can hold, rounded up
+     *                 to a power of two.
+     * @param policy What to do when the queue is full.
+     */
+    LogQueue(ConsoleWriter& writer, size_t capacity = CAPACITY_DEFAULT, OverflowPolicy policy = BLOCK);
+
+    LogQueue(const LogQueue&) = delete;
+
+    LogQueue& operator=(const LogQueue&) = delete;
+
+    /**
+     * Writes the remaining records and stops the consumer thread. No
+     * records should be pushed concurrently.
+     */
+    virtual ~LogQueue();
+
+    /**
+     * Adds the specified record to the queue. The record is written as it
+     * is, so it should end with a newline. The contents of @c record are
+     * swapped with those of a slot, so afterwards it is empty but may have
+     * the capacity of an earlier record, which avoids allocating for the
+     * next record.
+     * @param record The record to add.
+     * @return Whether the record was added; false if it was discarded
+     *         because the queue was full.
+     */
+    bool push(std::string& record);
+
+    bool push(std::string&& record) {
+        return push(record);
+    }
+
+    /**
+     * Waits until all records pushed before this call are written and the
+     * ConsoleWriter is flushed.
+     */
+    void flush();
+
+    /**
+     * Returns the number of records that can be queued.
+     * @return The capacity of the queue.
+     */
+    size_t getCapacity() const { return mask + 1; }
+
+    OverflowPolicy getOverflowPolicy() const { return policy; }
+
+    /**
+     * Returns the number of records discarded because the queue was full.
+     * @return The number of discarded records.
+     */
+    size_t getDropped() const { return dropped.load(std::memory_order_relaxed); }
+
+    /**
+     * Returns the number of times push() had to wait because the queue was
+     * full.
+     * @return The number of times push() had to wait.
+     */
+    size_t getStalls() const { return stalls.load(std::memory_order_relaxed); }
+};
+
+} // namespace libfrugi
@@ -9,13 +9,19 @@
 
 #include "libfrugi/Location.h"
 #include "libfrugi/ConsoleWriter.h"
+#include <libfrugi/Config.h>
+#include "libfrugi/LogQueue.h"
+#include <atomic>
+#include <mutex>
+#include <thread>
 #include <vector>
-#include <set>
 #include <unordered_map>
 #include <unistd.h>
 
 namespace libfrugi {
 
+class BinaryLog;
+
 class MessageFormatter {
 public:
     class MessageType {
@@ -136,55 +142,135 @@ public:
 
     static const int VERBOSITY_DEFAULT;
 
+    /**
+     * The class of messages reported with a class index that has not been
+     * registered: enabled, with the default verbosity.
+     */
+    static const MessageClass DEFAULT_CLASS;
+
 private:
 
+    /**
+     * A buffered message. The text is stored in the arena and the file name
+     * is interned, so the location only holds the line and column numbers.
+     */
     class MSG {
     public:
-        MSG(unsigned int id, Location loc, int indent, std::string message, MessageType type) : id(id), loc(loc),
-                                                                                                indent(indent),
-                                                                                                message(message),
-                                                                                                type(type) {
-            pid = getpid();
+        MSG(unsigned int id, unsigned int file, const Location& loc, int indent, size_t offset, size_t length,
+            MessageType type, pid_t pid) : id(id), file(file), loc(loc), indent(indent), offset(offset),
+                                           length(length), type(type), pid(pid) {
         }
 
         unsigned int id;
+        unsigned int file;
         Location loc;
         int indent;
-        std::string message;
+        size_t offset;
+        size_t length;
         MessageType type;
         pid_t pid;
+    };
 
-        bool operator<(const MSG& other) const {
-            if(loc.getFileName().length() > 0 && loc.getFileName() == other.loc.getFileName()) {
-                if(loc.getFirstLine() < other.loc.getFirstLine()) return true;
-                if(loc.getFirstLine() > other.loc.getFirstLine()) return false;
-                if(loc.getFirstColumn() < other.loc.getFirstColumn()) return true;
-                if(loc.getFirstColumn() > other.loc.getFirstColumn()) return false;
-                if(id < other.id) return true;
-                if(id > other.id) return false;
-                return false;
-            } else {
-                return id < other.id;
-            }
-        }
+    /**
+     * Indicates a message without a file name.
+     */
+    static const unsigned int NO_FILE;
+
+    /**
+     * The buffered messages of one thread, or of all threads if reporting is
+     * not concurrent. For each interned file name, the buffer keeps the id
+     * of the first message about the file, which determines where messages
+     * about the file are printed. flush() takes the messages out under the
+     * lock of the buffer, which is otherwise only taken by its own thread.
+     */
+    class Buffer {
+    public:
+        std::mutex mutex;
+        std::vector<MSG> messages;
+        std::string arena;
+        std::unordered_map<std::string, unsigned int> fileIndex;
+        std::vector<const std::string*> fileNames;
+        std::vector<unsigned int> fileFirst;
+        std::vector<MSG> takenMessages;
+        std::string takenArena;
+        std::vector<const std::string*> takenFileNames;
+        std::vector<unsigned int> takenFileFirst;
+
+        /**
+         * Adds the specified message. The file name of @c loc is cleared.
+         */
+        void add(unsigned int id, Location& loc, const std::string& str, const MessageType& mType, int indent,
+                 pid_t pid);
+
+        /**
+         * Moves the messages to the taken messages, keeping the capacity of
+         * both for reuse.
+         */
+        void take();
+    };
+
+    /**
+     * A taken message and the id of the message its group is printed at.
+     */
+    class Entry {
+    public:
+        const MSG* msg;
+        const Buffer* buffer;
+        unsigned int group;
 
-        bool operator==(const MSG& other) const {
-            return id == other.id;
+        Entry(const MSG* msg, const Buffer* buffer, unsigned int group) : msg(msg), buffer(buffer), group(group) {
         }
     };
 
+    static std::atomic<unsigned long> serials;
+
     ConsoleWriter consoleWriter;
     bool m_useColoredMessages;
-    std::set<MSG> messages;
+    Buffer mainBuffer;
+    bool concurrent;
+    std::atomic<unsigned long> serial;
+    std::mutex buffersMutex;
+    std::unordered_map<std::thread::id, Buffer*> buffers;
+    std::vector<Entry> entries;
+    std::unordered_map<std::string, unsigned int> groups;
+    Location scratchLocation;
+    std::string scratchText;
+    std::atomic<unsigned int> nextId;
     std::unordered_map<std::string, size_t> messageClassIndex;
     std::vector<MessageClass> messageClasses;
-    unsigned int errors;
-    unsigned int warnings;
+    std::atomic<unsigned int> errors;
+    std::atomic<unsigned int> warnings;
     bool m_autoFlush;
     int verbosity;
     int _indent;
+    LogQueue* queue;
+    BinaryLog* binaryLog;
 
-    void print(const MSG& msg);
+    void print(ConsoleWriter& writer, const Location& loc, const std::string& str, const MessageType& mType,
+               int indent, pid_t pid);
+
+    /**
+     * Renders the specified message into a record for the queue, using the
+     * colours and postfix of the ConsoleWriter.
+     */
+    std::string render(const Location& loc, const std::string& str, const MessageType& mType, int indent,
+                       pid_t pid);
+
+    /**
+     * Queues, buffers or prints the specified message, depending on the mode.
+     */
+    void report(Location& loc, const std::string& str, const MessageType& mType, int indent, pid_t pid);
+
+    /**
+     * Returns the buffer of the calling thread.
+     */
+    Buffer& threadBuffer();
+
+    /**
+     * Deletes the buffers of the threads, so no other thread may be
+     * reporting.
+     */
+    void clearBuffers();
 
 public:
 
@@ -193,12 +279,14 @@ public:
     }
 
     MessageFormatter(std::ostream& out)
-            : consoleWriter(out), m_useColoredMessages(false), errors(0), warnings(0), m_autoFlush(false),
-              verbosity(VERBOSITY_DEFAULT), _indent(false) {
+            : consoleWriter(out), m_useColoredMessages(false), concurrent(false), serial(++serials), nextId(1),
+              errors(0), warnings(0), m_autoFlush(false), verbosity(VERBOSITY_DEFAULT), _indent(false),
+              queue(nullptr), binaryLog(nullptr) {
 
     }
 
     virtual ~MessageFormatter() {
+        clearBuffers();
     }
 
     /**
@@ -383,10 +471,78 @@ public:
                            const MessageClass& messageClass = MessageClass());
 
     /**
-     * Flush all pending messages to the output.
+     * Reports a message that was recorded earlier, e.g., by a BinaryLog,
+     * with the indentation and process id it was recorded with. It is not
+     * filtered by verbosity and never written to a binary log.
+     * @param loc The location of the message.
+     * @param str The text of the message.
+     * @param mType The type of the message.
+     * @param indent The indentation of the message.
+     * @param pid The id of the process that reported the message.
+     */
+    virtual void replayAt(Location loc, const std::string& str, const MessageType& mType, int indent, pid_t pid);
+
+    /**
+     * Flush all pending messages to the output. If a queue is set, this
+     * waits until the queued messages are written. If a binary log is set,
+     * its messages are written to its file.
      */
     virtual void flush();
 
+    /**
+     * Sets the queue to hand messages to. While a queue is set, each message
+     * is rendered by the reporting thread and pushed to the queue right
+     * away, instead of being buffered and ordered by location; the consumer
+     * thread of the queue writes it. Reporting messages from multiple
+     * threads is then supported, as long as the settings of this
+     * MessageFormatter, such as the indentation and the message classes,
+     * are not changed concurrently. Call flush() before writing to the
+     * ConsoleWriter directly, e.g. using reportErrors().
+     * The queue is not owned by this MessageFormatter.
+     * @param queue The queue to push messages to, or nullptr to disable.
+     */
+    void setQueue(LogQueue* queue) {
+        flush();
+        this->queue = queue;
+    }
+
+    LogQueue* getQueue() const { return queue; }
+
+    /**
+     * Sets the binary log to record messages in. While a binary log is set,
+     * each message that passes the verbosity filter is copied into the
+     * binary log along with its location and indentation, instead of being
+     * printed; the frugi-logdecode tool or BinaryLog::decode() renders them
+     * later. Reporting from multiple threads is supported, as with a queue.
+     * The binary log is not owned by this MessageFormatter.
+     * @param binaryLog The binary log to record messages in, or nullptr to
+     *                  disable.
+     */
+    void setBinaryLog(BinaryLog* binaryLog) {
+        flush();
+        this->binaryLog = binaryLog;
+    }
+
+    BinaryLog* getBinaryLog() const { return binaryLog; }
+
+    /**
+     * Sets whether messages can be reported from multiple threads
+     * concurrently. In concurrent mode, each thread buffers its messages in
+     * a buffer of its own, and ids and counters are atomic, so reporting
+     * threads do not take a shared lock. flush() merges the buffers in the
+     * same order as in the normal mode. Messages are buffered even if auto
+     * flush is enabled. The settings of this MessageFormatter, such as the
+     * indentation and the message classes, should not be changed
+     * concurrently.
+     * @param concurrent Whether to support concurrent reporting.
+     */
+    void setConcurrent(bool concurrent) {
+        if(!concurrent) flush();
+        this->concurrent = concurrent;
+    }
+
+    bool isConcurrent() const { return concurrent; }
+
     /**
      * Set whether or not to use coloured messages.
      * @param useColoredMessages true/false: whether or not to use coloured messages.
@@ -426,6 +582,23 @@ public:
         this->verbosity = verbosity;
     }
 
+    /**
+     * Returns whether a message of the specified message class would be
+     * printed, i.e., whether the class is enabled and its verbosity is not
+     * higher than the set level of verbosity. This can be used to avoid
+     * building the text of messages that are filtered out; see
+     * LIBFRUGI_MESSAGE().
+     * @param messageClass The message class to check.
+     * @return Whether a message of the class would be printed.
+     */
+    bool willPrint(const MessageClass& messageClass) const {
+        return messageClass.isEnabled() && messageClass.getVerbosity() <= verbosity;
+    }
+
+    bool willPrint(const size_t& messageClassIndex) const {
+        return willPrint(findMessageClass(messageClassIndex));
+    }
+
     /**
      * Set whether or not to use auto flush.
      * When autoflush is enabled: a flush is performed after each message.
@@ -455,8 +628,27 @@ public:
         return getMessageClass(classIndex);
     }
 
+    /**
+     * Returns the message class with the specified index, registering it if
+     * needed. This may grow the table of message classes, so classes should
+     * be set up before reporting concurrently.
+     * @param classIndex The index of the message class.
+     * @return The message class.
+     */
     MessageFormatter::MessageClass& getMessageClass(size_t classIndex);
 
+    /**
+     * Returns the message class with the specified index, or DEFAULT_CLASS
+     * if it has not been registered. Unlike getMessageClass(), this does not
+     * modify the formatter, so it is safe to use while reporting
+     * concurrently.
+     * @param classIndex The index of the message class.
+     * @return The message class.
+     */
+    const MessageFormatter::MessageClass& findMessageClass(size_t classIndex) const {
+        return classIndex < messageClasses.size() ? messageClasses[classIndex] : DEFAULT_CLASS;
+    }
+
     MessageFormatter::MessageClass& getMessageClass(std::string className);
 
     MessageFormatter::MessageClass& newMessageClass(size_t classIndex, std::string classname);
@@ -491,4 +683,67 @@ public:
 
 };
 
-} // namespace libfrugi
\ No newline at end of file
+} // namespace libfrugi
+
+/**
+ * Reports a message of the specified type and message class, like
+ * MessageFormatter::message(), but only evaluates the text if the message
+ * will be printed. A message that is filtered out costs a check of the
+ * message class and the verbosity, instead of building its text. E.g.:
+ *   LIBFRUGI_MESSAGE(formatter, MessageFormatter::MessageType::Action, DEBUG, "state " + state.toString());
+ * The formatter and the message class are evaluated exactly once.
+ */
+#define LIBFRUGI_MESSAGE(formatter, mType, messageClass, text) \
+    do { \
+        ::libfrugi::MessageFormatter& libfrugi_formatter = (formatter); \
+        auto&& libfrugi_class = (messageClass); \
+        if(libfrugi_formatter.willPrint(libfrugi_class)) { \
+            libfrugi_formatter.message((text), (mType), libfrugi_class); \
+        } \
+    } while(0)
+
+/**
+ * Reports a message at the specified location, like
+ * MessageFormatter::messageAt(), but only evaluates the location and the
+ * text if the message will be printed.
+ */
+#define LIBFRUGI_MESSAGE_AT(formatter, loc, mType, messageClass, text) \
+    do { \
+        ::libfrugi::MessageFormatter& libfrugi_formatter = (formatter); \
+        auto&& libfrugi_class = (messageClass); \
+        if(libfrugi_formatter.willPrint(libfrugi_class)) { \
+            libfrugi_formatter.messageAt((loc), (text), (mType), libfrugi_class); \
+        } \
+    } while(0)
+
+/**
+ * Reports a message with the specified verbosity, which must be a constant
+ * expression. If the verbosity is higher than LIBFRUGI_MAX_VERBOSITY, the
+ * message is compiled out entirely: nothing is evaluated and no code or
+ * string literals end up in the binary. Otherwise, it is reported like
+ * LIBFRUGI_MESSAGE() with an anonymous message class of that verbosity, so
+ * it is only printed if the verbosity is set at least that high. E.g.:
+ *   LIBFRUGI_VERBOSE(formatter, 3, MessageFormatter::MessageType::Action, "visiting " + node.toString());
+ * LIBFRUGI_MAX_VERBOSITY is set using the CMake variable of the same name.
+ * The check is done where the macro is expanded, so a source file can also
+ * define LIBFRUGI_MAX_VERBOSITY before including this header to compile out
+ * more of its own messages.
+ */
+#define LIBFRUGI_VERBOSE(formatter, verbosity, mType, text) \
+    do { \
+        if constexpr((verbosity) <= LIBFRUGI_MAX_VERBOSITY) { \
+            LIBFRUGI_MESSAGE(formatter, mType, ::libfrugi::MessageFormatter::MessageClass((int)(verbosity)), text); \
+        } \
+    } while(0)
+
+/**
+ * Reports a message with the specified verbosity at the specified location,
+ * like LIBFRUGI_VERBOSE().
+ */
+#define LIBFRUGI_VERBOSE_AT(formatter, verbosity, loc, mType, text) \
+    do { \
+        if constexpr((verbosity) <= LIBFRUGI_MAX_VERBOSITY) { \
+            LIBFRUGI_MESSAGE_AT(formatter, loc, mType, ::libfrugi::MessageFormatter::MessageClass((int)(verbosity)), \
+                                text); \
+        } \
+    } while(0)
@@ -0,0 +1,113 @@
+/*
+ * NumberFormat.h
+ *
+ * Part of a general library.
+ *
+ * @author Freark van der Berg
+ */
+#pragma once
+
+#include <charconv>
+#include <cstddef>
+#include <cstdio>
+#include <ios>
+#include <type_traits>
+
+#include <libfrugi/Config.h>
+
+namespace libfrugi {
+
+/**
+ * Locale-free conversion of numbers to text, using std::to_chars.
+ * Integers are written in decimal. Floating point numbers are written in
+ * the shortest form that reads back to the same value.
+ */
+class NumberFormat {
+public:
+
+    /**
+     * The maximum number of characters format() writes.
+     */
+    static constexpr size_t CHARS_MAX = 64;
+
+    /**
+     * The maximum precision of format() with a precision, at which any
+     * number still fits in CHARS_MAX characters in scientific notation.
+     */
+    static constexpr int PRECISION_MAX = 40;
+
+    /**
+     * Returns whether numbers of type T can be formatted by format().
+     * @return Whether numbers of type T can be formatted.
+     */
+    template<typename T>
+    static constexpr bool isSupported() {
+        if constexpr(std::is_integral_v<T>) {
+            // Character types and bool are not streamed as numbers
+            return !std::is_same_v<T, bool> && !std::is_same_v<T, char> && !std::is_same_v<T, signed char>
+                   && !std::is_same_v<T, unsigned char> && !std::is_same_v<T, wchar_t>
+                   && !std::is_same_v<T, char16_t> && !std::is_same_v<T, char32_t>;
+        } else if constexpr(std::is_floating_point_v<T>) {
+            return LIBFRUGI_HAVE_FLOAT_TO_CHARS;
+        } else {
+            return false;
+        }
+    }
+
+    /**
+     * Returns whether the specified stream is in its default number
+     * formatting state, i.e., streaming a number to it would give the same
+     * result as format() (apart from the precision of floating point numbers).
+     * @param out The stream to check.
+     * @return Whether the stream uses the default number formatting.
+     */
+    static bool isDefault(const std::ios_base& out) {
+        const std::ios_base::fmtflags mask = std::ios_base::basefield | std::ios_base::floatfield
+                                             | std::ios_base::showpos | std::ios_base::showpoint
+                                             | std::ios_base::showbase | std::ios_base::uppercase;
+        return out.width() == 0 && out.precision() == 6 && (out.flags() & mask) == std::ios_base::dec;
+    }
+
+    /**
+     * Writes the specified number to the buffer starting at @c first, which
+     * needs to have room for at least CHARS_MAX characters.
+     * @param first The start of the buffer to write to.
+     * @param value The number to write.
+     * @return The end of the written characters.
+     */
+    template<typename T>
+    static char* format(char* first, T value) {
+        static_assert(isSupported<T>(), "type not supported by NumberFormat");
+        std::to_chars_result result = std::to_chars(first, first + CHARS_MAX, value);
+        return result.ptr;
+    }
+
+    /**
+     * Writes the specified floating point number with a fixed number of
+     * digits after the decimal point. Numbers that do not fit in CHARS_MAX
+     * characters that way are written in scientific notation.
+     * @param first The start of the buffer to write to.
+     * @param value The number to write.
+     * @param precision The number of digits after the decimal point, at
+     *                  most PRECISION_MAX.
+     * @return The end of the written characters.
+     */
+    template<typename T>
+    static char* format(char* first, T value, int precision) {
+        static_assert(std::is_floating_point_v<T>, "only floating point numbers have a precision");
+        if(precision < 0) precision = 0;
+        if(precision > PRECISION_MAX) precision = PRECISION_MAX;
+#if LIBFRUGI_HAVE_FLOAT_TO_CHARS
+        std::to_chars_result result = std::to_chars(first, first + CHARS_MAX, value, std::chars_format::fixed,
+                                                    precision);
+        if(result.ec == std::errc()) return result.ptr;
+        return std::to_chars(first, first + CHARS_MAX, value, std::chars_format::scientific, precision).ptr;
+#else
+        int n = snprintf(first, CHARS_MAX, "%.*f", precision, (double)value);
+        if(n < 0 || (size_t)n >= CHARS_MAX) n = snprintf(first, CHARS_MAX, "%.*e", precision, (double)value);
+        return first + n;
+#endif
+    }
+};
+
+} // namespace libfrugi
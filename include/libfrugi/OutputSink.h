@@ -0,0 +1,241 @@
+/*
+ * OutputSink.h
+ *
+ * Part of a general library.
+ *
+ * @author Freark van der Berg
+ */
+#pragma once
+
+#include <string>
+
+#include "libfrugi/SegmentBuffer.h"
+
+namespace libfrugi {
+
+/**
+ * An OutputSink is the destination of a streaming FileWriter. Whenever the
+ * bottom segment of the FileWriter grows beyond its high-water mark, its
+ * chunks are handed to the sink, which writes them out.
+ * Errors are sticky: once writing failed, further output is discarded and
+ * the error is returned by flush() and close().
+ */
+class OutputSink {
+public:
+    virtual ~OutputSink() {
+    }
+
+    /**
+     * Writes the specified chunks, in order. The sink takes ownership of
+     * the chunks.
+     * @param chunks The chunks to write.
+     */
+    virtual void write(SegmentBuffer::ChunkList chunks) = 0;
+
+    /**
+     * Makes sure everything written so far has been handed to the
+     * underlying file.
+     * @return 0 on success, an errno value otherwise.
+     */
+    virtual int flush() {
+        return 0;
+    }
+
+    /**
+     * Makes sure everything written so far is stored durably, so that
+     * after a crash the file contains at least this data as a valid prefix.
+     * @return 0 on success, an errno value otherwise.
+     */
+    virtual int sync() {
+        return flush();
+    }
+
+    /**
+     * Flushes and closes the sink. Nothing can be written afterwards.
+     * @return 0 on success, an errno value otherwise.
+     */
+    virtual int close() {
+        return flush();
+    }
+};
+
+/**
+ * An OutputSink writing to a file descriptor using writev().
+ */
+class FileDescriptorSink : public OutputSink {
+private:
+    int fd;
+    bool ownsFd;
+    int error;
+public:
+
+    /**
+     * Creates a new FileDescriptorSink writing to the specified file
+     * descriptor.
+     * @param fd The file descriptor to write to.
+     * @param ownsFd Whether to close the file descriptor in close().
+     */
+    FileDescriptorSink(int fd, bool ownsFd = false) : fd(fd), ownsFd(ownsFd), error(0) {
+    }
+
+    virtual ~FileDescriptorSink() {
+        close();
+    }
+
+    /**
+     * Opens the specified file for writing, truncating it.
+     * @param path The path of the file to open.
+     * @param sink The created sink is written here.
+     * @return 0 on success, an errno value otherwise.
+     */
+    static int open(const std::string& path, FileDescriptorSink*& sink);
+
+    virtual void write(SegmentBuffer::ChunkList chunks);
+
+    virtual int flush() {
+        return error;
+    }
+
+    virtual int sync();
+
+    virtual int close();
+
+    int getFileDescriptor() const { return fd; }
+};
+
+/**
+ * An OutputSink writing to a memory-mapped file. The file is grown in large
+ * steps and the chunks are copied straight into the mapping, avoiding a
+ * system call per write. On close, the file is truncated to the size of the
+ * written data. sync() flushes the mapping to disk and truncates the file to
+ * the data written so far, so a crash afterwards leaves a valid prefix.
+ */
+class MappedFileSink : public OutputSink {
+private:
+    int fd;
+    char* map;
+    size_t mapSize;
+    size_t fileSize;
+    size_t size;
+    size_t growStep;
+    int error;
+
+    MappedFileSink(int fd, size_t growStep) : fd(fd), map(nullptr), mapSize(0), fileSize(0), size(0),
+                                              growStep(growStep), error(0) {
+    }
+
+    /**
+     * Grows the file and the mapping to hold at least @c needed bytes.
+     */
+    int reserve(size_t needed);
+
+public:
+
+    /**
+     * The default number of bytes by which the file is grown.
+     */
+    static const size_t GROW_STEP_DEFAULT;
+
+    virtual ~MappedFileSink() {
+        close();
+    }
+
+    /**
+     * Opens the specified file for writing, truncating it.
+     * @param path The path of the file to open.
+     * @param sink The created sink is written here.
+     * @param growStep The number of bytes by which the file is grown.
+     * @return 0 on success, an errno value otherwise.
+     */
+    static int open(const std::string& path, MappedFileSink*& sink, size_t growStep = GROW_STEP_DEFAULT);
+
+    virtual void write(SegmentBuffer::ChunkList chunks);
+
+    virtual int flush() {
+        return error;
+    }
+
+    virtual int sync();
+
+    virtual int close();
+
+    /**
+     * Returns the number of bytes written so far.
+     * @return The number of bytes written so far.
+     */
+    size_t getSize() const { return size; }
+};
+
+/**
+ * An OutputSink that only writes the file if its contents change, so that
+ * its modification time stays the same otherwise. The data is compared with
+ * the existing file while it comes in, without writing anything. At the
+ * first difference, a temporary file next to the target is created, the
+ * matching part of the existing file is copied into it and the rest of the
+ * data is written to it. On close(), the temporary file replaces the target.
+ */
+class ChangedFileSink : public OutputSink {
+private:
+    std::string path;
+    std::string tempPath;
+    int oldFd;
+    size_t oldSize;
+    unsigned int oldMode;
+    size_t offset;
+    char* buffer;
+    FileDescriptorSink* out;
+    int error;
+    bool closed;
+    bool changed;
+
+    ChangedFileSink(const std::string& path, int oldFd, size_t oldSize, unsigned int oldMode);
+
+    /**
+     * Returns whether the next @c n bytes of the existing file are equal to
+     * the specified data.
+     */
+    bool matches(const char* data, size_t n);
+
+    /**
+     * Creates the temporary file and copies the part of the existing file
+     * that matched into it.
+     */
+    int startWriting();
+
+public:
+
+    /**
+     * The number of bytes compared or copied at once.
+     */
+    static const size_t BLOCK_SIZE;
+
+    virtual ~ChangedFileSink() {
+        close();
+    }
+
+    /**
+     * Opens the specified file for writing if its contents change. The file
+     * does not have to exist.
+     * @param path The path of the file to write to.
+     * @param sink The created sink is written here.
+     * @return 0 on success, an errno value otherwise.
+     */
+    static int open(const std::string& path, ChangedFileSink*& sink);
+
+    virtual void write(SegmentBuffer::ChunkList chunks);
+
+    virtual int flush();
+
+    virtual int sync();
+
+    virtual int close();
+
+    /**
+     * Returns whether the file was written, i.e., whether its contents
+     * changed or it did not exist. Only final after close().
+     * @return Whether the file was written.
+     */
+    bool isChanged() const { return changed; }
+};
+
+} // namespace libfrugi
@@ -0,0 +1,87 @@
+/*
+ * ParallelFileWriter.h
+ *
+ * Part of a general library.
+ *
+ * @author Freark van der Berg
+ */
+#pragma once
+
+#include <vector>
+
+#include "libfrugi/FileWriter.h"
+
+namespace libfrugi {
+
+/**
+ * The ParallelFileWriter class allows multiple threads to write parts of
+ * the output of a single FileWriter. It hands out shards: independent
+ * FileWriter objects that inherit the indentation, prefix, postfix,
+ * indentation prefix and auto prefixing of the parent at the time they are
+ * created. With auto prefixing, whether the first line of a shard is
+ * prefixed depends on whether the shard before it ends a line, so that is
+ * decided when joining. Each
+ * shard should only be used by one thread at a time.
+ * When joined, the contents of the shards are moved to the parent in the
+ * order in which the shards were created, without copying them. The result
+ * is the same as writing the contents of the shards to the parent one after
+ * another from a single thread.
+ *
+ * Creating shards and joining them should be done by the thread owning the
+ * parent, e.g., create all shards, start the worker threads, wait for them,
+ * and join.
+ */
+class ParallelFileWriter {
+private:
+    FileWriter& parent;
+    std::vector<FileWriter*> shards;
+public:
+
+    /**
+     * Creates a new ParallelFileWriter for the specified parent.
+     * @param parent The FileWriter to which the shards are joined.
+     * @param shards The number of shards to create.
+     */
+    ParallelFileWriter(FileWriter& parent, size_t shards = 0);
+
+    /**
+     * Destroys the shards. Contents not yet joined are discarded.
+     */
+    virtual ~ParallelFileWriter();
+
+    /**
+     * Creates a new shard, ordered after all shards created before.
+     * @return The new shard.
+     */
+    FileWriter& createShard();
+
+    /**
+     * Returns the shard with the specified index.
+     * @param index The index of the shard, in order of creation.
+     * @return The shard with the specified index.
+     */
+    FileWriter& getShard(size_t index) {
+        return *shards[index];
+    }
+
+    FileWriter& operator[](size_t index) {
+        return getShard(index);
+    }
+
+    /**
+     * Returns the number of shards.
+     * @return The number of shards.
+     */
+    size_t getShardCount() const {
+        return shards.size();
+    }
+
+    /**
+     * Moves the contents of all shards to the parent, in order of creation.
+     * The shards are destroyed afterwards. All threads writing to the
+     * shards need to be finished.
+     */
+    void join();
+};
+
+} // namespace libfrugi
@@ -0,0 +1,160 @@
+/*
+ * Progress.h
+ *
+ * Part of a general library.
+ *
+ * @author Freark van der Berg
+ */
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "libfrugi/ConsoleWriter.h"
+
+namespace libfrugi {
+
+/**
+ * The Progress class shows live progress in a status line at the bottom of
+ * a terminal. Hot code only increments counters, which is a single relaxed
+ * atomic addition. A renderer thread reads the counters and redraws the
+ * status line at a fixed rate.
+ * The ConsoleWriter is switched to line-buffered mode while the progress is
+ * shown, so other output, such as that of a MessageFormatter using the same
+ * ConsoleWriter, scrolls above the status line. If the ConsoleWriter does
+ * not write to a terminal, nothing is shown.
+ */
+class Progress {
+public:
+
+    /**
+     * A counter shown in the status line. Each counter has a cache line of
+     * its own, so counters incremented by different threads do not slow
+     * each other down.
+     */
+    class alignas(64) Counter {
+    private:
+        friend class Progress;
+
+        std::atomic<uint64_t> value;
+        std::string name;
+        uint64_t total;
+        uint64_t lastValue;
+
+        Counter(const std::string& name, uint64_t total) : value(0), name(name), total(total), lastValue(0) {
+        }
+
+    public:
+
+        /**
+         * Adds the specified amount to this counter.
+         * @param n The amount to add.
+         */
+        void add(uint64_t n = 1) {
+            value.fetch_add(n, std::memory_order_relaxed);
+        }
+
+        /**
+         * Sets the value of this counter.
+         * @param v The new value.
+         */
+        void set(uint64_t v) {
+            value.store(v, std::memory_order_relaxed);
+        }
+
+        uint64_t get() const {
+            return value.load(std::memory_order_relaxed);
+        }
+
+        /**
+         * Sets the value at which this counter is complete, or 0 if unknown.
+         * Should not be called while the progress is shown.
+         * @param total The total.
+         */
+        void setTotal(uint64_t total) { this->total = total; }
+    };
+
+    /**
+     * The default number of times per second the status line is redrawn.
+     */
+    static const unsigned int RATE_DEFAULT;
+
+private:
+    ConsoleWriter& writer;
+    std::vector<Counter*> counters;
+    std::string title;
+    unsigned int rate;
+    std::thread renderer;
+    std::mutex mutex;
+    std::condition_variable stopRequested;
+    bool stopping;
+    bool wasLineBuffered;
+    std::chrono::steady_clock::time_point started;
+    std::chrono::steady_clock::time_point lastRender;
+
+    void run();
+
+    /**
+     * Renders the status line. The caller holds the mutex, which guards the
+     * time and values of the previous render.
+     */
+    std::string renderLocked();
+
+public:
+
+    /**
+     * Creates a new Progress object drawing to the specified ConsoleWriter.
+     * @param writer The ConsoleWriter to draw the status line with.
+     * @param rate The number of times per second to redraw the status line.
+     */
+    Progress(ConsoleWriter& writer, unsigned int rate = RATE_DEFAULT);
+
+    /**
+     * Stops showing the progress and destroys the counters.
+     */
+    virtual ~Progress();
+
+    /**
+     * Creates a new counter, shown after the counters created before.
+     * Counters should be created before start().
+     * @param name The name shown before the value of the counter.
+     * @param total The value at which the counter is complete, or 0 if
+     *              unknown. If known, a percentage is shown.
+     * @return The new counter.
+     */
+    Counter& addCounter(const std::string& name, uint64_t total = 0);
+
+    /**
+     * Sets the text shown at the start of the status line.
+     * Should not be called while the progress is shown.
+     * @param title The text.
+     */
+    void setTitle(const std::string& title) { this->title = title; }
+
+    /**
+     * Starts showing the progress, using a renderer thread.
+     */
+    void start();
+
+    /**
+     * Stops showing the progress and removes the status line.
+     */
+    void stop();
+
+    /**
+     * Returns the status line for the current values of the counters: the
+     * title, the elapsed time and for each counter its value, the percentage
+     * of its total and the rate at which it increased since the previous
+     * call. Can be called while the renderer thread is running.
+     * @return The status line.
+     */
+    std::string render();
+};
+
+} // namespace libfrugi
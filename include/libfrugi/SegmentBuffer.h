@@ -0,0 +1,467 @@
+/*
+ * SegmentBuffer.h
+ *
+ * Part of a general library.
+ *
+ * @author Freark van der Berg
+ */
+#pragma once
+
+#include <climits>
+#include <cstddef>
+#include <memory>
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+namespace libfrugi {
+
+class OutputSink;
+
+/**
+ * The SegmentBuffer class is a stream buffer that stores its contents as a
+ * list of chunks instead of one contiguous string. The contents of one
+ * SegmentBuffer can be moved to the end of another in constant time using
+ * splice(), without copying the bytes. The contents are only flattened into
+ * a single string when str() is called.
+ */
+class SegmentBuffer : public std::streambuf {
+public:
+
+    /**
+     * The list through which other threads return chunks to the pool of the
+     * thread that allocated them.
+     */
+    class ChunkHome;
+
+    /**
+     * A single block of memory holding part of the contents. The data is
+     * stored directly after the Chunk header. Destroyed chunks with one of
+     * the capacities used while growing are kept in a per-thread pool and
+     * reused by create(). A chunk destroyed by another thread than the one
+     * that allocated it goes back to the pool of the allocating thread, so
+     * a thread that hands its output to another one still reuses its chunks.
+     */
+    class Chunk {
+    public:
+        enum Flags {
+            HOLE = 1
+        };
+
+        Chunk* next;
+        ChunkHome* home;
+        size_t size;
+        size_t capacity;
+        unsigned int flags;
+
+        char* data() { return reinterpret_cast<char*>(this + 1); }
+
+        const char* data() const { return reinterpret_cast<const char*>(this + 1); }
+
+        static Chunk* create(size_t capacity);
+
+        static void destroy(Chunk* chunk);
+    };
+
+    /**
+     * A list of chunks taken out of a SegmentBuffer. The list owns the
+     * chunks and destroys them when it is destroyed.
+     */
+    class ChunkList {
+    public:
+        Chunk* head;
+        Chunk* tail;
+        size_t size;
+
+        ChunkList() : head(nullptr), tail(nullptr), size(0) {
+        }
+
+        ChunkList(ChunkList&& other) : head(other.head), tail(other.tail), size(other.size) {
+            other.head = other.tail = nullptr;
+            other.size = 0;
+        }
+
+        ChunkList& operator=(ChunkList&& other) {
+            if(this != &other) {
+                clear();
+                head = other.head;
+                tail = other.tail;
+                size = other.size;
+                other.head = other.tail = nullptr;
+                other.size = 0;
+            }
+            return *this;
+        }
+
+        ChunkList(const ChunkList&) = delete;
+
+        ChunkList& operator=(const ChunkList&) = delete;
+
+        ~ChunkList() {
+            clear();
+        }
+
+        bool empty() const { return head == nullptr; }
+
+        /**
+         * Moves the chunks of @c other to the end of this list.
+         * @param other The list to move the chunks of.
+         */
+        void append(ChunkList&& other);
+
+        /**
+         * Destroys all chunks in this list.
+         */
+        void clear();
+    };
+
+    /**
+     * The state of a hole, shared by the buffer containing it and the Hole
+     * handles referring to it. The buffer resets the chunk to nullptr when
+     * the hole is filled or its chunk is discarded, so stale handles never
+     * touch a destroyed chunk.
+     */
+    class HoleState {
+    public:
+        Chunk* chunk;
+        SegmentBuffer* owner;
+    };
+
+    /**
+     * A position in a SegmentBuffer of which the contents are filled in
+     * later using fill(). The position moves along with the contents when
+     * they are spliced into another buffer.
+     */
+    class Hole {
+    private:
+        friend class SegmentBuffer;
+
+        std::shared_ptr<HoleState> state;
+
+        Hole(const std::shared_ptr<HoleState>& state) : state(state) {
+        }
+
+    public:
+        Hole() {
+        }
+
+        /**
+         * Returns whether this hole refers to a position that is not filled
+         * yet and still exists. A hole is closed once it is filled, or when
+         * the buffer containing it is cleared, destroyed or taken out using
+         * takeAll().
+         * @return Whether this hole can be filled.
+         */
+        bool isOpen() const { return state && state->chunk; }
+    };
+
+    /**
+     * The capacity of the first chunk that is allocated.
+     */
+    static const size_t CHUNK_SIZE_MIN;
+
+    /**
+     * Chunks grow until this capacity. Writes larger than this get a chunk
+     * of their own.
+     */
+    static const size_t CHUNK_SIZE_MAX;
+
+    /**
+     * Spliced contents up to this size are copied into the free space of the
+     * current chunk instead of being linked, to avoid many tiny chunks.
+     */
+    static const size_t SPLICE_COPY_MAX;
+
+    /**
+     * The number of bytes of destroyed chunks of each capacity that each
+     * thread keeps for reuse.
+     */
+    static const size_t POOL_SIZE_MAX;
+
+    /**
+     * Returns the number of chunks allocated from the heap by all threads.
+     * Chunks reused from the pool are not counted.
+     * @return The number of allocated chunks.
+     */
+    static size_t getAllocatedChunks();
+
+    /**
+     * Returns the number of chunks reused from the pool by all threads.
+     * @return The number of reused chunks.
+     */
+    static size_t getReusedChunks();
+
+private:
+    Chunk* head;
+    Chunk* tail;
+    size_t syncedSize;
+    size_t nextCapacity;
+    OutputSink* sink;
+    size_t highWaterMark;
+    std::vector<std::shared_ptr<HoleState>> holes;
+
+    /**
+     * Closes all open holes, so their handles can no longer fill them. The
+     * hole chunks remain as empty chunks.
+     */
+    void closeHoles();
+
+    /**
+     * Commits the bytes written since the last call into the tail chunk.
+     */
+    void syncTail() {
+        if(tail) {
+            size_t n = pptr() - pbase();
+            tail->size += n;
+            syncedSize += n;
+            setp(pptr(), epptr());
+        }
+    }
+
+    /**
+     * Lets the put area point to the free space of the tail chunk.
+     */
+    void attachTail() {
+        if(tail) {
+            setp(tail->data() + tail->size, tail->data() + tail->capacity);
+        } else {
+            setp(nullptr, nullptr);
+        }
+    }
+
+    /**
+     * Moves the put pointer @c n bytes forward.
+     */
+    void advance(size_t n) {
+        while(n > INT_MAX) {
+            pbump(INT_MAX);
+            n -= INT_MAX;
+        }
+        pbump((int)n);
+    }
+
+    /**
+     * Appends a new chunk that has room for at least @c minimum bytes.
+     */
+    void grow(size_t minimum);
+
+    /**
+     * Writes the contents to the sink if they exceed the high-water mark.
+     * @param keepTail Whether to keep the tail chunk in this buffer.
+     */
+    void drainIfNeeded(bool keepTail);
+
+protected:
+    virtual int_type overflow(int_type c);
+
+    virtual std::streamsize xsputn(const char_type* s, std::streamsize n);
+
+    virtual pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which);
+
+public:
+
+    SegmentBuffer() : head(nullptr), tail(nullptr), syncedSize(0), nextCapacity(CHUNK_SIZE_MIN), sink(nullptr),
+                      highWaterMark(0) {
+    }
+
+    SegmentBuffer(const SegmentBuffer&) = delete;
+
+    SegmentBuffer& operator=(const SegmentBuffer&) = delete;
+
+    virtual ~SegmentBuffer();
+
+    /**
+     * Returns the number of bytes in this buffer.
+     * @return The number of bytes in this buffer.
+     */
+    size_t size() const {
+        return syncedSize + (pptr() - pbase());
+    }
+
+    /**
+     * Returns whether this buffer is empty.
+     * @return Whether this buffer is empty.
+     */
+    bool empty() const {
+        return size() == 0;
+    }
+
+    /**
+     * Returns a pointer to at least @c n bytes of contiguous space at the end
+     * of this buffer. The space can be written to directly and then added
+     * to the contents using commit(). This avoids the overhead of the stream
+     * interface for small writes.
+     * @param n The number of bytes needed.
+     * @return A pointer to the space.
+     */
+    char* reserve(size_t n) {
+        if((size_t)(epptr() - pptr()) < n) {
+            grow(n);
+        }
+        return pptr();
+    }
+
+    /**
+     * Adds the bytes written in the space returned by reserve() up to
+     * @c end to the contents.
+     * @param end The end of the written bytes.
+     */
+    void commit(char* end) {
+        advance(end - pptr());
+    }
+
+    /**
+     * Moves the contents of @c other to the end of this buffer. Afterwards,
+     * @c other is empty. This does not copy the contents, unless they are
+     * small enough to fit in the free space of the current chunk.
+     * @param other The buffer to move the contents of.
+     */
+    void splice(SegmentBuffer& other);
+
+    /**
+     * Removes all contents. The first chunk is kept for reuse.
+     */
+    void clear();
+
+    /**
+     * Takes the chunks out of this buffer. The contents of the chunks are
+     * no longer part of this buffer afterwards. Chunks from the first open
+     * hole onwards are not taken.
+     * @param keepTail Whether to keep the tail chunk and its contents in
+     *                 this buffer, so it can be written to further.
+     * @return The list of chunks taken out of this buffer.
+     */
+    ChunkList take(bool keepTail);
+
+    /**
+     * Takes all chunks out of this buffer, including those after open
+     * holes. Open holes are written as if they were filled with nothing and
+     * can no longer be filled.
+     * @return The list of chunks taken out of this buffer.
+     */
+    ChunkList takeAll();
+
+    /**
+     * Reserves a hole at the current end of this buffer, to be filled later
+     * using fill(). Contents after an open hole are not written to the sink,
+     * so the hole should be filled before too much is written after it.
+     * @return The reserved hole.
+     */
+    Hole reserveHole();
+
+    /**
+     * Fills the specified hole with the specified text. The hole is resolved
+     * in whichever buffer its contents have been moved to in the meantime.
+     * Each hole can be filled once. Does nothing if the hole is not open,
+     * e.g., because the buffer containing it was cleared or destroyed.
+     * @param hole The hole to fill.
+     * @param s The text to fill the hole with.
+     * @param n The length of the text.
+     */
+    static void fill(Hole& hole, const char* s, size_t n);
+
+    /**
+     * Returns the number of holes in this buffer that are not filled yet.
+     * @return The number of open holes.
+     */
+    size_t getOpenHoles() const { return holes.size(); }
+
+    /**
+     * Lets this buffer write its contents to the specified sink whenever
+     * they exceed the specified number of bytes. This keeps the memory used
+     * by the buffer bounded. The sink is not owned by the buffer.
+     * @param sink The sink to write to, or nullptr to disable.
+     * @param highWaterMark The number of bytes after which to write.
+     */
+    void setSink(OutputSink* sink, size_t highWaterMark) {
+        this->sink = sink;
+        this->highWaterMark = highWaterMark;
+    }
+
+    OutputSink* getSink() const { return sink; }
+
+    /**
+     * Calls @c f with the data and size of each chunk, in order.
+     * @param f The function to call for each chunk.
+     */
+    template<typename F>
+    void forEach(F&& f) const {
+        for(const Chunk* chunk = head; chunk; chunk = chunk->next) {
+            size_t n = chunk->size;
+            if(chunk == tail) n += pptr() - pbase();
+            if(n > 0) f(chunk->data(), n);
+        }
+    }
+
+    /**
+     * Appends the contents of this buffer to the specified string.
+     * @param s The string to append to.
+     */
+    void appendTo(std::string& s) const;
+
+    /**
+     * Writes the contents of this buffer to the specified stream.
+     * @param out The stream to write to.
+     */
+    void writeTo(std::ostream& out) const;
+
+    /**
+     * Returns the contents of this buffer as a single string.
+     * @return The contents of this buffer.
+     */
+    std::string str() const {
+        std::string s;
+        appendTo(s);
+        return s;
+    }
+};
+
+/**
+ * An output stream writing to a SegmentBuffer. It can be used instead of a
+ * std::stringstream for output.
+ */
+class SegmentStream : public std::ostream {
+private:
+    SegmentBuffer sb;
+public:
+    SegmentStream() : std::ostream(&sb) {
+    }
+
+    SegmentBuffer& buffer() { return sb; }
+
+    const SegmentBuffer& buffer() const { return sb; }
+
+    /**
+     * Returns the contents of the stream as a single string.
+     * @return The contents of the stream.
+     */
+    std::string str() const {
+        return sb.str();
+    }
+
+    /**
+     * Replaces the contents of the stream with the specified string.
+     * @param s The new contents.
+     */
+    void str(const std::string& s) {
+        sb.clear();
+        write(s.data(), s.size());
+    }
+
+    /**
+     * Removes the contents and resets the state and formatting settings to
+     * those of a new stream, so this stream can be reused. The first chunk
+     * is kept.
+     */
+    void reset() {
+        sb.clear();
+        std::ostream::clear();
+        flags(std::ios_base::skipws | std::ios_base::dec);
+        precision(6);
+        width(0);
+        fill(' ');
+    }
+};
+
+} // namespace libfrugi
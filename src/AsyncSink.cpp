@@ -0,0 +1,80 @@
+/*
+ * AsyncSink.cpp
+ *
+ * Part of a general library.
+ *
+ * @author Freark van der Berg
+ */
+
+#include "libfrugi/AsyncSink.h"
+
+namespace libfrugi {
+
+const size_t AsyncSink::CAPACITY_DEFAULT = 2;
+
+AsyncSink::AsyncSink(OutputSink* inner, size_t capacity)
+        : inner(inner), capacity(capacity ? capacity : 1), busy(false), stopping(false), stalls(0) {
+    thread = std::thread(&AsyncSink::run, this);
+}
+
+AsyncSink::~AsyncSink() {
+    close();
+    delete inner;
+}
+
+void AsyncSink::run() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while(true) {
+        workAvailable.wait(lock, [this] { return !queue.empty() || stopping; });
+        if(queue.empty()) break;
+        SegmentBuffer::ChunkList chunks = std::move(queue.front());
+        queue.pop_front();
+        busy = true;
+        lock.unlock();
+        spaceAvailable.notify_all();
+        inner->write(std::move(chunks));
+        lock.lock();
+        busy = false;
+        spaceAvailable.notify_all();
+    }
+}
+
+void AsyncSink::write(SegmentBuffer::ChunkList chunks) {
+    std::unique_lock<std::mutex> lock(mutex);
+    if(stopping) return;
+    if(queue.size() >= capacity) {
+        ++stalls;
+        spaceAvailable.wait(lock, [this] { return queue.size() < capacity; });
+    }
+    queue.push_back(std::move(chunks));
+    lock.unlock();
+    workAvailable.notify_one();
+}
+
+void AsyncSink::drain() {
+    std::unique_lock<std::mutex> lock(mutex);
+    spaceAvailable.wait(lock, [this] { return queue.empty() && !busy; });
+}
+
+int AsyncSink::flush() {
+    drain();
+    return inner->flush();
+}
+
+int AsyncSink::sync() {
+    drain();
+    return inner->sync();
+}
+
+int AsyncSink::close() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if(stopping) return inner->flush();
+        stopping = true;
+    }
+    workAvailable.notify_one();
+    thread.join();
+    return inner->close();
+}
+
+} // namespace libfrugi
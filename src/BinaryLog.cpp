@@ -0,0 +1,593 @@
+/*
+ * BinaryLog.cpp
+ *
+ * Part of a general library.
+ *
+ * @author Freark van der Berg
+ */
+
+#include "libfrugi/BinaryLog.h"
+#include "libfrugi/NumberFormat.h"
+
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+
+namespace libfrugi {
+
+namespace {
+
+const char MAGIC[8] = {'F', 'R', 'U', 'G', 'I', 'L', 'O', 'G'};
+const uint32_t VERSION = 1;
+const size_t HEADER_SIZE = 32;
+const size_t RING_SIZE_MIN = 4096;
+const std::chrono::milliseconds DRAIN_INTERVAL(1);
+const size_t ENTRY_STEP = 64 * 1024;
+
+/**
+ * The call sites registered by all threads. Ids start at 1, as 0 is used
+ * for entries defining a call site.
+ */
+class Registry {
+public:
+    std::mutex mutex;
+    std::vector<BinaryLog::Site> sites;
+
+    static Registry& get() {
+        static Registry registry;
+        return registry;
+    }
+};
+
+uint64_t nanoseconds(std::chrono::nanoseconds duration) {
+    return (uint64_t)duration.count();
+}
+
+void put(std::string& s, uint32_t value) {
+    s.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void put(std::string& s, uint64_t value) {
+    s.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+/**
+ * Reads a value of type T at @c p, if it lies before @c end.
+ */
+template<typename T>
+bool get(const char*& p, const char* end, T& value) {
+    if((size_t)(end - p) < sizeof(T)) return false;
+    memcpy(&value, p, sizeof(T));
+    p += sizeof(T);
+    return true;
+}
+
+const MessageFormatter::MessageType& messageType(uint32_t type) {
+    typedef MessageFormatter::MessageType MessageType;
+    switch(type) {
+        case MessageType::NOTIFY:
+            return MessageType::Notify;
+        case MessageType::NOTIFYH:
+            return MessageType::NotifyH;
+        case MessageType::ACTION:
+            return MessageType::Action;
+        case MessageType::ACTION2:
+            return MessageType::Action2;
+        case MessageType::ACTION3:
+            return MessageType::Action3;
+        case MessageType::WARNING:
+            return MessageType::Warning;
+        case MessageType::ERR:
+            return MessageType::Error;
+        case MessageType::SUCCESS:
+            return MessageType::Success;
+        case MessageType::FAILURE:
+            return MessageType::Failure;
+        case MessageType::NOTE:
+            return MessageType::Note;
+        case MessageType::FILE:
+            return MessageType::File;
+        case MessageType::TITLE:
+            return MessageType::Title;
+        default:
+            return MessageType::Message;
+    }
+}
+
+/**
+ * A call site as read back from a binary log.
+ */
+class DecodedSite {
+public:
+    uint32_t type;
+    std::string file;
+    unsigned int line;
+    unsigned int flags;
+    std::string format;
+    std::string argTypes;
+
+    DecodedSite() : type(0), line(0), flags(0) {
+    }
+};
+
+/**
+ * Appends the argument of the specified type at @c p to @c text.
+ */
+bool decodeArg(char argType, const char*& p, const char* end, std::string& text) {
+    char buffer[NumberFormat::CHARS_MAX];
+    switch(argType) {
+        case 's': {
+            uint32_t n;
+            if(!get(p, end, n) || (size_t)(end - p) < n) return false;
+            text.append(p, n);
+            p += n;
+            return true;
+        }
+        case 'c':
+        case 'b': {
+            char c;
+            if(!get(p, end, c)) return false;
+            if(argType == 'c') {
+                text += c;
+            } else {
+                text += c ? "true" : "false";
+            }
+            return true;
+        }
+        case 'i': {
+            int64_t v;
+            if(!get(p, end, v)) return false;
+            text.append(buffer, NumberFormat::format(buffer, v) - buffer);
+            return true;
+        }
+        case 'u': {
+            uint64_t v;
+            if(!get(p, end, v)) return false;
+            text.append(buffer, NumberFormat::format(buffer, v) - buffer);
+            return true;
+        }
+        case 'd': {
+            double v;
+            if(!get(p, end, v)) return false;
+#if LIBFRUGI_HAVE_FLOAT_TO_CHARS
+            text.append(buffer, NumberFormat::format(buffer, v) - buffer);
+#else
+            text.append(buffer, snprintf(buffer, sizeof(buffer), "%.17g", v));
+#endif
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+} // namespace
+
+const size_t BinaryLog::RING_SIZE_DEFAULT = 1 << 20;
+const size_t BinaryLog::STRING_MAX = 4096;
+const uint32_t BinaryLog::ID_SITE = 0;
+const uint32_t BinaryLog::ID_PADDING = UINT32_MAX;
+
+std::atomic<unsigned long> BinaryLog::serials(0);
+
+uint32_t BinaryLog::registerSite(const MessageFormatter::MessageType& type, const char* file, unsigned int line,
+                                 const char* format, const char* argTypes, unsigned int flags) {
+    Registry& registry = Registry::get();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    registry.sites.push_back(Site{type.getType(), file, line, format, argTypes, flags});
+    return (uint32_t)registry.sites.size();
+}
+
+uint32_t BinaryLog::messageSite(const MessageFormatter::MessageType& type) {
+    typedef MessageFormatter::MessageType MessageType;
+    static std::atomic<uint32_t> sites[MessageType::NUMBEROF];
+    static std::mutex mutex;
+
+    size_t index = type.getType() < MessageType::NUMBEROF ? type.getType() : 0;
+    uint32_t site = sites[index].load(std::memory_order_acquire);
+    if(site) return site;
+    std::lock_guard<std::mutex> lock(mutex);
+    site = sites[index].load(std::memory_order_relaxed);
+    if(!site) {
+        site = registerSite(type, "", 0, "{}", Signature<std::string, int, int, int, int, int, std::string>::value,
+                            Site::LOCATED);
+        sites[index].store(site, std::memory_order_release);
+    }
+    return site;
+}
+
+void BinaryLog::message(const Location& loc, const std::string& str, const MessageFormatter::MessageType& type,
+                        int indent) {
+    writeRecord(messageSite(type), loc.getFileName(), loc.getFirstLine(), loc.getFirstColumn(), loc.getLastLine(),
+                loc.getLastColumn() + 1, indent, str);
+}
+
+BinaryLog::BinaryLog() : ringSize(RING_SIZE_DEFAULT), opened(false), serial(++serials), stopping(false),
+                         sitesWritten(0), stalls(0), dropped(0) {
+}
+
+BinaryLog::~BinaryLog() {
+    close();
+}
+
+BinaryLog::Ring& BinaryLog::threadRing() {
+    static thread_local unsigned long cachedSerial = 0;
+    static thread_local Ring* cached = nullptr;
+    if(cachedSerial == serial.load(std::memory_order_acquire)) return *cached;
+
+    std::lock_guard<std::mutex> lock(ringsMutex);
+    Ring*& ring = threadRings[std::this_thread::get_id()];
+
+    // A retired ring belongs to an exited thread with the same id
+    if(!ring || ring->retired.load(std::memory_order_relaxed)) {
+        rings.push_back(std::make_shared<Ring>(ringSize));
+        ring = rings.back().get();
+
+        // Rings that only the thread still holds were dropped by their log
+        static thread_local RingOwner owner;
+        auto& owned = owner.owned;
+        owned.erase(std::remove_if(owned.begin(), owned.end(),
+                                   [](const std::shared_ptr<Ring>& r) { return r.use_count() == 1; }), owned.end());
+        owned.push_back(rings.back());
+    }
+    cachedSerial = serial.load(std::memory_order_relaxed);
+    cached = ring;
+    return *ring;
+}
+
+char* BinaryLog::reserve(Ring& ring, size_t size) {
+    size_t tail = ring.tail.load(std::memory_order_relaxed);
+    size_t offset = tail & (ring.capacity - 1);
+    size_t room = ring.capacity - offset;
+    size_t needed = size <= room ? size : room + size;
+    if(ring.capacity - (tail - ring.head.load(std::memory_order_acquire)) < needed) {
+        stalls.fetch_add(1, std::memory_order_relaxed);
+        for(unsigned int attempt = 0;
+            ring.capacity - (tail - ring.head.load(std::memory_order_acquire)) < needed; ++attempt) {
+            if(attempt < 64) {
+                std::this_thread::yield();
+            } else {
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+            }
+        }
+    }
+    if(size > room) {
+
+        // Fill up the end, so the entry is contiguous at the start
+        uint32_t padding[2] = {ID_PADDING, (uint32_t)room};
+        memcpy(ring.data + offset, padding, sizeof(padding));
+        tail += room;
+        offset = 0;
+    }
+    ring.pending = tail + size;
+    return ring.data + offset;
+}
+
+int BinaryLog::open(const std::string& path, size_t ringSize) {
+    close();
+    int result = file.open(path);
+    if(result) return result;
+
+    // The ring buffers are recreated with the new size
+    {
+        std::lock_guard<std::mutex> lock(ringsMutex);
+        rings.clear();
+        threadRings.clear();
+        this->ringSize = RING_SIZE_MIN;
+        while(this->ringSize < ringSize) this->ringSize <<= 1;
+        serial.store(++serials, std::memory_order_release);
+    }
+
+    std::string header(MAGIC, sizeof(MAGIC));
+    put(header, VERSION);
+    put(header, (uint32_t)getpid());
+    put(header, nanoseconds(std::chrono::system_clock::now().time_since_epoch()));
+    put(header, nanoseconds(std::chrono::steady_clock::now().time_since_epoch()));
+    file.ss().write(header.data(), header.size());
+
+    sitesWritten = 0;
+    stopping = false;
+    opened.store(true, std::memory_order_relaxed);
+    drainer = std::thread(&BinaryLog::run, this);
+    return 0;
+}
+
+int BinaryLog::close() {
+    if(!opened.load(std::memory_order_relaxed)) return 0;
+    {
+        std::lock_guard<std::mutex> lock(stopMutex);
+        stopping = true;
+    }
+    stopRequested.notify_all();
+    drainer.join();
+    drain(true);
+    opened.store(false, std::memory_order_relaxed);
+    return file.close();
+}
+
+int BinaryLog::flush() {
+    if(!opened.load(std::memory_order_relaxed)) return 0;
+    drain(true);
+    std::lock_guard<std::mutex> lock(drainMutex);
+    return file.flush();
+}
+
+void BinaryLog::drain(bool all) {
+    std::lock_guard<std::mutex> lock(drainMutex);
+    drainRings.clear();
+    {
+        std::lock_guard<std::mutex> ringsLock(ringsMutex);
+        for(auto& ring: rings) {
+            drainRings.push_back(ring.get());
+        }
+    }
+
+    // A ring retired before its tail is read holds no more messages after it
+    drainRetired.clear();
+    drainTails.clear();
+    for(Ring* ring: drainRings) {
+        drainRetired.push_back(ring->retired.load(std::memory_order_acquire));
+        drainTails.push_back(ring->tail.load(std::memory_order_acquire));
+    }
+
+    // Messages are only logged after their call site is registered, so
+    // this includes the call sites of all messages about to be written
+    std::ostream& out = file.ss();
+    {
+        Registry& registry = Registry::get();
+        std::lock_guard<std::mutex> registryLock(registry.mutex);
+        std::string entry;
+        for(; sitesWritten < registry.sites.size(); ++sitesWritten) {
+            const Site& site = registry.sites[sitesWritten];
+            uint32_t fileLength = (uint32_t)strlen(site.file);
+            uint32_t formatLength = (uint32_t)strlen(site.format);
+            uint32_t argCount = (uint32_t)strlen(site.argTypes);
+            size_t size = align(9 * sizeof(uint32_t) + fileLength + formatLength + argCount);
+            entry.clear();
+            put(entry, ID_SITE);
+            put(entry, (uint32_t)size);
+            put(entry, sitesWritten + 1);
+            put(entry, (uint32_t)site.type);
+            put(entry, (uint32_t)site.line);
+            put(entry, (uint32_t)site.flags);
+            put(entry, fileLength);
+            put(entry, formatLength);
+            put(entry, argCount);
+            entry.append(site.file, fileLength);
+            entry.append(site.format, formatLength);
+            entry.append(site.argTypes, argCount);
+            entry.resize(size);
+            out.write(entry.data(), entry.size());
+        }
+    }
+
+    // Merge the rings, each of which is in order of the timestamps already.
+    // Consecutive messages of one ring are written at once, up to the first
+    // message of another ring that is earlier
+    uint64_t cutoff = UINT64_MAX - 1;
+    if(!all) {
+        cutoff = nanoseconds(std::chrono::steady_clock::now().time_since_epoch() - DRAIN_INTERVAL);
+    }
+    drainHeads.clear();
+    drainNext.clear();
+    for(size_t i = 0; i < drainRings.size(); ++i) {
+        drainHeads.push_back(drainRings[i]->head.load(std::memory_order_relaxed));
+        drainNext.push_back(nextTimestamp(*drainRings[i], drainHeads[i], drainTails[i]));
+    }
+    while(!drainRings.empty()) {
+        size_t first = 0;
+        for(size_t i = 1; i < drainRings.size(); ++i) {
+            if(drainNext[i] < drainNext[first]) first = i;
+        }
+        if(drainNext[first] > cutoff) break;
+        uint64_t second = cutoff;
+        for(size_t i = 0; i < drainRings.size(); ++i) {
+            if(i != first) second = std::min(second, drainNext[i]);
+        }
+
+        Ring& ring = *drainRings[first];
+        size_t& head = drainHeads[first];
+        size_t offset = head & (ring.capacity - 1);
+        size_t end = head;
+        uint64_t timestamp = drainNext[first];
+        do {
+            uint32_t size;
+            memcpy(&size, ring.data + (end & (ring.capacity - 1)) + sizeof(uint32_t), sizeof(size));
+            end += size;
+
+            // A run ends at padding, as the next message is at the start
+            if(end >= drainTails[first] || !(end & (ring.capacity - 1))) {
+                timestamp = UINT64_MAX;
+                break;
+            }
+            uint32_t id;
+            memcpy(&id, ring.data + (end & (ring.capacity - 1)), sizeof(id));
+            if(id == ID_PADDING) break;
+            memcpy(&timestamp, ring.data + (end & (ring.capacity - 1)) + 2 * sizeof(uint32_t), sizeof(timestamp));
+        } while(timestamp <= second);
+        out.write(ring.data + offset, end - head);
+        head = end;
+        drainNext[first] = nextTimestamp(ring, head, drainTails[first]);
+        ring.head.store(head, std::memory_order_release);
+    }
+
+    // Remove the rings of exited threads once they are empty
+    std::lock_guard<std::mutex> ringsLock(ringsMutex);
+    for(size_t i = 0; i < drainRings.size(); ++i) {
+        if(!drainRetired[i] || drainHeads[i] != drainTails[i]) continue;
+        Ring* ring = drainRings[i];
+        auto it = threadRings.find(ring->thread);
+        if(it != threadRings.end() && it->second == ring) threadRings.erase(it);
+        rings.erase(std::find_if(rings.begin(), rings.end(),
+                                 [ring](const std::shared_ptr<Ring>& r) { return r.get() == ring; }));
+    }
+}
+
+uint64_t BinaryLog::nextTimestamp(const Ring& ring, size_t& head, size_t tail) {
+    while(head < tail) {
+        const char* p = ring.data + (head & (ring.capacity - 1));
+        uint32_t header[2];
+        memcpy(header, p, sizeof(header));
+        if(header[0] != ID_PADDING) {
+            uint64_t timestamp;
+            memcpy(&timestamp, p + sizeof(header), sizeof(timestamp));
+            return timestamp;
+        }
+        head += header[1];
+    }
+    return UINT64_MAX;
+}
+
+void BinaryLog::run() {
+    std::unique_lock<std::mutex> lock(stopMutex);
+    while(!stopRequested.wait_for(lock, DRAIN_INTERVAL, [this] { return stopping; })) {
+        lock.unlock();
+        drain(false);
+        lock.lock();
+    }
+}
+
+int BinaryLog::decode(const std::string& path, MessageFormatter& formatter, bool timestamps) {
+    FILE* in = fopen(path.c_str(), "rb");
+    if(!in) return errno;
+
+    int result = 0;
+    char header[HEADER_SIZE];
+    uint32_t version;
+    uint32_t pid;
+    uint64_t started;
+    if(fread(header, 1, sizeof(header), in) != sizeof(header) || memcmp(header, MAGIC, sizeof(MAGIC))) {
+        fclose(in);
+        return EINVAL;
+    }
+    memcpy(&version, header + 8, sizeof(version));
+    memcpy(&pid, header + 12, sizeof(pid));
+    memcpy(&started, header + 24, sizeof(started));
+    if(version != VERSION) {
+        fclose(in);
+        return EINVAL;
+    }
+
+    // Sizes are checked against the rest of the file before allocating. The
+    // size of a pipe is not known, so its entries are read in steps instead
+    size_t remaining = SIZE_MAX;
+    if(!fseek(in, 0, SEEK_END)) {
+        long size = ftell(in);
+        if(size < 0 || fseek(in, HEADER_SIZE, SEEK_SET)) {
+            result = errno;
+            fclose(in);
+            return result;
+        }
+        remaining = (size_t)size - HEADER_SIZE;
+    }
+
+    // Call sites are defined in order of their ids, starting at 1
+    std::vector<DecodedSite> sites(1);
+    std::vector<char> entry;
+    std::string text;
+    char stamp[32];
+    for(;;) {
+        uint32_t head[2];
+        size_t n = fread(head, 1, sizeof(head), in);
+        if(n == 0) break;
+        if(n != sizeof(head) || head[1] < sizeof(head) || head[1] % 8 || head[1] > remaining) {
+            result = EINVAL;
+            break;
+        }
+        if(remaining != SIZE_MAX) remaining -= head[1];
+        entry.clear();
+        for(size_t left = head[1] - sizeof(head); left > 0;) {
+            size_t step = std::min(left, ENTRY_STEP);
+            size_t offset = entry.size();
+            entry.resize(offset + step);
+            size_t got = fread(entry.data() + offset, 1, step, in);
+            entry.resize(offset + got);
+            if(got != step) break;
+            left -= step;
+        }
+        if(entry.size() != head[1] - sizeof(head) || ferror(in)) {
+            result = EINVAL;
+            break;
+        }
+        const char* p = entry.data();
+        const char* end = p + entry.size();
+
+        if(head[0] == ID_PADDING) continue;
+
+        if(head[0] == ID_SITE) {
+            uint32_t fields[7];
+            if(!get(p, end, fields)) {
+                result = EINVAL;
+                break;
+            }
+            if(fields[0] != sites.size() || (size_t)(end - p) < (size_t)fields[4] + fields[5] + fields[6]) {
+                result = EINVAL;
+                break;
+            }
+            DecodedSite& site = sites.emplace_back();
+            site.type = fields[1];
+            site.line = fields[2];
+            site.flags = fields[3];
+            site.file.assign(p, fields[4]);
+            p += fields[4];
+            site.format.assign(p, fields[5]);
+            p += fields[5];
+            site.argTypes.assign(p, fields[6]);
+            continue;
+        }
+
+        uint64_t timestamp;
+        if(head[0] >= sites.size() || !get(p, end, timestamp)) {
+            result = EINVAL;
+            break;
+        }
+        const DecodedSite& site = sites[head[0]];
+        Location loc(site.file, site.line);
+        int64_t indent = 0;
+        size_t arg = 0;
+        if(site.flags & Site::LOCATED) {
+            uint32_t n;
+            int64_t lines[4];
+            if(site.argTypes.compare(0, 6, "siiiii") || !get(p, end, n) || (size_t)(end - p) < n) {
+                result = EINVAL;
+                break;
+            }
+            std::string file(p, n);
+            p += n;
+            if(!get(p, end, lines) || !get(p, end, indent)) {
+                result = EINVAL;
+                break;
+            }
+            loc = Location(file, (int)lines[0], (int)lines[1], (int)lines[2], (int)lines[3]);
+            arg = 6;
+        }
+        text.clear();
+        if(timestamps) {
+            snprintf(stamp, sizeof(stamp), "[%.6f] ", (double)(int64_t)(timestamp - started) / 1e9);
+            text += stamp;
+        }
+
+        // Replace each "{}" by the next argument
+        const std::string& format = site.format;
+        size_t start = 0;
+        for(size_t brace = format.find("{}"); brace != std::string::npos; brace = format.find("{}", start)) {
+            text.append(format, start, brace - start);
+            start = brace + 2;
+            if(arg < site.argTypes.size()) {
+                if(!decodeArg(site.argTypes[arg++], p, end, text)) {
+                    result = EINVAL;
+                    break;
+                }
+            } else {
+                text += "{}";
+            }
+        }
+        if(result) break;
+        text.append(format, start, std::string::npos);
+        formatter.replayAt(loc, text, messageType(site.type), (int)indent, (pid_t)pid);
+    }
+    fclose(in);
+    return result;
+}
+
+} // namespace libfrugi
@@ -0,0 +1,242 @@
+/*
+ * CompressingSink.cpp
+ *
+ * Part of a general library.
+ *
+ * @author Freark van der Berg
+ */
+
+#include "libfrugi/CompressingSink.h"
+
+#include <errno.h>
+
+#include <libfrugi/Config.h>
+
+#if LIBFRUGI_HAVE_ZLIB
+#include <zlib.h>
+#endif
+#if LIBFRUGI_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+namespace libfrugi {
+
+namespace {
+
+enum Mode {
+    MODE_CONTINUE,
+    MODE_FLUSH,
+    MODE_END
+};
+
+const size_t OUTPUT_CHUNK_SIZE = 64 * 1024;
+
+} // namespace
+
+/**
+ * The state of the compressor and the chunks of compressed output that are
+ * not yet handed to the inner sink.
+ */
+class CompressingSink::State {
+public:
+#if LIBFRUGI_HAVE_ZLIB
+    z_stream zs;
+#endif
+#if LIBFRUGI_HAVE_ZSTD
+    ZSTD_CCtx* zstd;
+#endif
+    SegmentBuffer::ChunkList out;
+
+    /**
+     * Returns the free space at the end of the output, adding a chunk if
+     * the last one is full.
+     */
+    char* space(size_t& available) {
+        if(!out.tail || out.tail->size == out.tail->capacity) {
+            SegmentBuffer::ChunkList chunk;
+            chunk.head = chunk.tail = SegmentBuffer::Chunk::create(OUTPUT_CHUNK_SIZE);
+            out.append(std::move(chunk));
+        }
+        available = out.tail->capacity - out.tail->size;
+        return out.tail->data() + out.tail->size;
+    }
+
+    /**
+     * Adds @c n bytes written in the space returned by space() to the output.
+     */
+    void produced(size_t n) {
+        out.tail->size += n;
+        out.size += n;
+    }
+};
+
+const int CompressingSink::LEVEL_DEFAULT = -1;
+
+CompressingSink::CompressingSink(OutputSink* inner, Format format, int level)
+        : inner(inner), format(format), state(nullptr), pending(false), error(0) {
+    if(!isSupported(format)) {
+        error = ENOTSUP;
+        return;
+    }
+    state = new State();
+    switch(format) {
+        case GZIP:
+#if LIBFRUGI_HAVE_ZLIB
+            state->zs.zalloc = Z_NULL;
+            state->zs.zfree = Z_NULL;
+            state->zs.opaque = Z_NULL;
+            // A window of 15 bits plus 16 selects the gzip container
+            if(deflateInit2(&state->zs, level == LEVEL_DEFAULT ? 1 : level, Z_DEFLATED, 15 + 16, 8,
+                            Z_DEFAULT_STRATEGY) != Z_OK) {
+                error = ENOMEM;
+            }
+#endif
+            break;
+        case ZSTD:
+#if LIBFRUGI_HAVE_ZSTD
+            state->zstd = ZSTD_createCCtx();
+            if(!state->zstd) {
+                error = ENOMEM;
+            } else {
+                ZSTD_CCtx_setParameter(state->zstd, ZSTD_c_compressionLevel, level == LEVEL_DEFAULT ? 3 : level);
+            }
+#endif
+            break;
+    }
+    if(error) {
+        delete state;
+        state = nullptr;
+    }
+}
+
+CompressingSink::~CompressingSink() {
+    close();
+    delete inner;
+}
+
+bool CompressingSink::isSupported(Format format) {
+    switch(format) {
+        case GZIP:
+            return LIBFRUGI_HAVE_ZLIB;
+        case ZSTD:
+            return LIBFRUGI_HAVE_ZSTD;
+    }
+    return false;
+}
+
+void CompressingSink::compress(const SegmentBuffer::Chunk* chunks, int mode) {
+    if(error || !state) return;
+    size_t available;
+    switch(format) {
+        case GZIP: {
+#if LIBFRUGI_HAVE_ZLIB
+            z_stream& zs = state->zs;
+            for(const SegmentBuffer::Chunk* chunk = chunks; chunk && !error; chunk = chunk->next) {
+                zs.next_in = (Bytef*)chunk->data();
+                zs.avail_in = chunk->size;
+                while(zs.avail_in > 0) {
+                    zs.next_out = (Bytef*)state->space(available);
+                    zs.avail_out = available;
+                    if(deflate(&zs, Z_NO_FLUSH) == Z_STREAM_ERROR) {
+                        error = EIO;
+                        break;
+                    }
+                    state->produced(available - zs.avail_out);
+                }
+            }
+            if(mode != MODE_CONTINUE && !error) {
+                int flush = mode == MODE_END ? Z_FINISH : Z_SYNC_FLUSH;
+                int result;
+                do {
+                    zs.next_out = (Bytef*)state->space(available);
+                    zs.avail_out = available;
+                    result = deflate(&zs, flush);
+                    if(result == Z_STREAM_ERROR) {
+                        error = EIO;
+                        break;
+                    }
+                    state->produced(available - zs.avail_out);
+                } while(mode == MODE_END ? result != Z_STREAM_END : zs.avail_out == 0);
+            }
+#endif
+            break;
+        }
+        case ZSTD: {
+#if LIBFRUGI_HAVE_ZSTD
+            for(const SegmentBuffer::Chunk* chunk = chunks; chunk && !error; chunk = chunk->next) {
+                ZSTD_inBuffer in = {chunk->data(), chunk->size, 0};
+                while(in.pos < in.size) {
+                    ZSTD_outBuffer out = {state->space(available), available, 0};
+                    if(ZSTD_isError(ZSTD_compressStream2(state->zstd, &out, &in, ZSTD_e_continue))) {
+                        error = EIO;
+                        break;
+                    }
+                    state->produced(out.pos);
+                }
+            }
+            if(mode != MODE_CONTINUE && !error) {
+                ZSTD_EndDirective directive = mode == MODE_END ? ZSTD_e_end : ZSTD_e_flush;
+                ZSTD_inBuffer in = {nullptr, 0, 0};
+                size_t remaining;
+                do {
+                    ZSTD_outBuffer out = {state->space(available), available, 0};
+                    remaining = ZSTD_compressStream2(state->zstd, &out, &in, directive);
+                    if(ZSTD_isError(remaining)) {
+                        error = EIO;
+                        break;
+                    }
+                    state->produced(out.pos);
+                } while(remaining != 0);
+            }
+#endif
+            break;
+        }
+    }
+
+    // Collect small amounts of output before handing them on, unless the
+    // output is flushed
+    if(mode != MODE_CONTINUE || state->out.size >= OUTPUT_CHUNK_SIZE) {
+        if(state->out.size > 0) {
+            inner->write(std::move(state->out));
+        }
+        state->out.clear();
+    }
+}
+
+void CompressingSink::write(SegmentBuffer::ChunkList chunks) {
+    pending = true;
+    compress(chunks.head, MODE_CONTINUE);
+}
+
+int CompressingSink::flush() {
+    if(pending) {
+        compress(nullptr, MODE_FLUSH);
+        pending = false;
+    }
+    int result = inner->flush();
+    return error ? error : result;
+}
+
+int CompressingSink::sync() {
+    flush();
+    int result = inner->sync();
+    return error ? error : result;
+}
+
+int CompressingSink::close() {
+    if(state) {
+        compress(nullptr, MODE_END);
+#if LIBFRUGI_HAVE_ZLIB
+        if(format == GZIP) deflateEnd(&state->zs);
+#endif
+#if LIBFRUGI_HAVE_ZSTD
+        if(format == ZSTD) ZSTD_freeCCtx(state->zstd);
+#endif
+        delete state;
+        state = nullptr;
+    }
+    int result = inner->close();
+    return error ? error : result;
+}
+
+} // namespace libfrugi
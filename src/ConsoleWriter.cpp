@@ -9,6 +9,14 @@
 #include "libfrugi/ConsoleWriter.h"
 
 #include <iostream>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef WIN32
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#endif
 
 namespace libfrugi {
 
@@ -108,7 +116,8 @@ const ConsoleWriter::Color ConsoleWriter::Color::BgWhiteBright(1, 47);
 #endif
 
 ConsoleWriter::ConsoleWriter(std::ostream& out)
-        : FileWriter(), out(out), ignoreColors(false), lastWasEndLine(false) {
+        : FileWriter(), out(out), ignoreColors(false), colors(false), lastWasEndLine(false), lineBuffered(false),
+          serial(++serials), statusActive(false), atStatusLine(true) {
 
     if(&out == &std::cout) {
         kindOfStream = 1;
@@ -119,33 +128,278 @@ ConsoleWriter::ConsoleWriter(std::ostream& out)
     }
 
     if(kindOfStream > 0) {
-#ifdef WIN32
-        CONSOLE_SCREEN_BUFFER_INFO out;
-        HANDLE hConsole = GetStdHandle(kindOfStream==1?STD_OUTPUT_HANDLE:STD_ERROR_HANDLE);
-        GetConsoleScreenBufferInfo(hConsole,&out);
-        colorStack.push(Color(out.wAttributes));
-#else
-        colorStack.push(ConsoleWriter::Color::Reset);
-#endif
+        terminal = Terminal::get(kindOfStream);
     }
+    colors = terminal.colors;
+
+    Registry& r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    r.writers.insert(this);
 }
 
-ConsoleWriter& ConsoleWriter::operator<<(ConsoleWriter::Color color) {
-    if(ignoreColors) { return *this; }
+ConsoleWriter::~ConsoleWriter() {
+    {
+        Registry& r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        r.writers.erase(this);
+    }
+    clearLines();
+}
+
+ConsoleWriter::Registry& ConsoleWriter::registry() {
+    static Registry registry;
+    return registry;
+}
+
+ConsoleWriter::LineOwner::~LineOwner() {
+    Registry& r = registry();
+    std::lock_guard<std::mutex> registryLock(r.mutex);
+    for(auto& entry: owned) {
+        if(!r.writers.count(entry.writer)) continue;
+        ConsoleWriter& writer = *entry.writer;
+        std::lock_guard<std::mutex> lock(writer.outMutex);
+
+        // A writer at the same address or clearLines() changes the serial
+        if(writer.serial.load(std::memory_order_relaxed) != entry.serial) continue;
+        auto it = writer.lines.find(std::this_thread::get_id());
+        if(it == writer.lines.end() || it->second != entry.buffer) continue;
+        writer.releaseLine(entry.buffer);
+        writer.lines.erase(it);
+    }
+}
+
+std::atomic<unsigned long> ConsoleWriter::serials(0);
+
+const ConsoleWriter::Terminal& ConsoleWriter::Terminal::get(int fd) {
+    static const Terminal standardOutput = detect(1);
+    static const Terminal standardError = detect(2);
+    if(fd == 1) return standardOutput;
+    if(fd == 2) return standardError;
+    static thread_local Terminal other;
+    other = detect(fd);
+    return other;
+}
+
+ConsoleWriter::Terminal ConsoleWriter::Terminal::detect(int fd) {
+    Terminal terminal;
+#ifndef WIN32
+    terminal.tty = isatty(fd);
+    const char* term = getenv("TERM");
+    const char* noColor = getenv("NO_COLOR");
+    const char* forceColor = getenv("FORCE_COLOR");
+    terminal.colors = terminal.tty && !(noColor && *noColor) && term && *term && strcmp(term, "dumb");
+    if(forceColor && *forceColor && strcmp(forceColor, "0")) {
+        terminal.colors = true;
+    }
+
+    if(terminal.tty) {
+        struct winsize size;
+        if(!ioctl(fd, TIOCGWINSZ, &size) && size.ws_col > 0) {
+            terminal.width = size.ws_col;
+        }
+    }
+    if(!terminal.width) {
+        const char* columns = getenv("COLUMNS");
+        if(columns) {
+            int width = atoi(columns);
+            if(width > 0) terminal.width = width;
+        }
+    }
+#endif
+    return terminal;
+}
+
+void ConsoleWriter::writeColor(const ConsoleWriter::Color& color) {
 #ifdef WIN32
 #error to implement
 #else
-    out << "\033[";
-    out << int(color.code[0]);
-    int i = 1;
-    while(i < 4 && color.code[i]) {
-        out << ";" << int(color.code[i]);
-        ++i;
-    }
-    out << "m";
-    i = 0;
+    std::ostream* target = &out;
+    ColorState* state = &colorState;
+    if(lineBuffered) {
+        LineBuffer& buffer = line();
+        target = &buffer.stream;
+        state = &buffer.colorState;
+    }
+    ColorState& colorState = *state;
+    ColorState next = colorState;
+    if(color.reset) {
+        next.bold = false;
+        next.foreground = 39;
+        next.background = 49;
+    }
+    if(color.bold >= 0) next.bold = color.bold;
+    if(color.foreground >= 0) next.foreground = color.foreground;
+    if(color.background >= 0) next.background = color.background;
+    next.known = !color.untracked;
+
+    if(colorState.known && next.known && next.bold == colorState.bold && next.foreground == colorState.foreground
+       && next.background == colorState.background) {
+        return;
+    }
+    target->write(color.escape, color.length);
+    colorState = next;
+#endif
+}
+
+ConsoleWriter::LineBuffer& ConsoleWriter::line() {
+    static thread_local unsigned long cachedSerial = 0;
+    static thread_local LineBuffer* cached = nullptr;
+    if(cachedSerial == serial.load(std::memory_order_acquire)) return *cached;
+
+    std::lock_guard<std::mutex> lock(outMutex);
+    LineBuffer*& buffer = lines[std::this_thread::get_id()];
+    if(!buffer) {
+        buffer = new LineBuffer(*this);
+
+        // Hand the buffer to the thread, so it is released when the thread
+        // exits; an earlier buffer of this writer has been cleared already
+        static thread_local LineOwner owner;
+        auto& owned = owner.owned;
+        for(size_t i = 0; i < owned.size();) {
+            if(owned[i].writer == this) {
+                owned[i] = owned.back();
+                owned.pop_back();
+            } else {
+                ++i;
+            }
+        }
+        owned.push_back({this, serial.load(std::memory_order_relaxed), buffer});
+    }
+    cachedSerial = serial.load(std::memory_order_relaxed);
+    cached = buffer;
+    return *buffer;
+}
+
+#ifndef WIN32
+namespace {
+
+void writeFully(int fd, const char* s, size_t n) {
+    while(n > 0) {
+        ssize_t written = ::write(fd, s, n);
+        if(written < 0) {
+            if(errno == EINTR) continue;
+            return;
+        }
+        s += written;
+        n -= written;
+    }
+}
+
+const char CLEAR_LINE[] = "\r\033[K";
+
+} // namespace
 #endif
-    return *this;
+
+void ConsoleWriter::publish(const char* s, size_t n) {
+#ifndef WIN32
+    if(kindOfStream > 0) {
+
+        // Text that is still buffered by the stream goes first
+        out.flush();
+        if(!statusActive.load(std::memory_order_acquire)) {
+            writeFully(kindOfStream, s, n);
+            return;
+        }
+
+        // Clear the status line, write the text and redraw the status line
+        // using a single write. After a partial line, the status line is
+        // only redrawn once the line is complete.
+        std::lock_guard<std::mutex> lock(statusMutex);
+        statusScratch.clear();
+        if(atStatusLine) statusScratch.append(CLEAR_LINE, sizeof(CLEAR_LINE) - 1);
+        statusScratch.append(s, n);
+        atStatusLine = s[n - 1] == '\n';
+        if(atStatusLine) statusScratch.append(status);
+        writeFully(kindOfStream, statusScratch.data(), statusScratch.size());
+        return;
+    }
+#endif
+    std::lock_guard<std::mutex> lock(outMutex);
+    out.write(s, n);
+}
+
+void ConsoleWriter::setStatusLine(const std::string& line) {
+#ifndef WIN32
+    if(!lineBuffered || kindOfStream == 0 || !terminal.tty) return;
+    std::lock_guard<std::mutex> lock(statusMutex);
+    status = line;
+    if(terminal.width > 0 && status.size() >= (size_t)terminal.width) {
+        status.resize(terminal.width - 1);
+    }
+    statusActive.store(!status.empty(), std::memory_order_release);
+
+    // While a partial line is on the terminal, the status line is drawn
+    // once that line is complete
+    if(!atStatusLine) return;
+    out.flush();
+    statusScratch.assign(CLEAR_LINE, sizeof(CLEAR_LINE) - 1);
+    statusScratch.append(status);
+    writeFully(kindOfStream, statusScratch.data(), statusScratch.size());
+#endif
+}
+
+void ConsoleWriter::setLineBuffered(bool lineBuffered) {
+    if(this->lineBuffered && !lineBuffered) {
+        setStatusLine("");
+        clearLines();
+    }
+    this->lineBuffered = lineBuffered;
+}
+
+void ConsoleWriter::clearLines() {
+    std::lock_guard<std::mutex> lock(outMutex);
+
+    // Invalidate the streams cached by the threads
+    serial.store(++serials, std::memory_order_release);
+    for(auto& entry: lines) {
+        releaseLine(entry.second);
+    }
+    lines.clear();
+}
+
+void ConsoleWriter::releaseLine(LineBuffer* buffer) {
+    if(!buffer->pending.empty()) {
+        if(kindOfStream > 0) {
+            publish(buffer->pending.data(), buffer->pending.size());
+        } else {
+            out.write(buffer->pending.data(), buffer->pending.size());
+        }
+    }
+    delete buffer;
+}
+
+void ConsoleWriter::LineBuffer::publish(bool partial) {
+    size_t n = pending.size();
+    if(!partial) {
+        size_t end = pending.rfind('\n');
+        n = end == std::string::npos ? 0 : end + 1;
+    }
+    if(n == 0) return;
+    writer.publish(pending.data(), n);
+    pending.erase(0, n);
+
+    // Other threads may have changed the colours in the meantime
+    colorState.known = false;
+}
+
+ConsoleWriter::LineBuffer::int_type ConsoleWriter::LineBuffer::overflow(int_type c) {
+    if(traits_type::eq_int_type(c, traits_type::eof())) {
+        return traits_type::not_eof(c);
+    }
+    pending.push_back(traits_type::to_char_type(c));
+    if(c == '\n') publish(false);
+    return c;
+}
+
+std::streamsize ConsoleWriter::LineBuffer::xsputn(const char_type* s, std::streamsize n) {
+    pending.append(s, n);
+    if(memchr(s, '\n', n)) publish(false);
+    return n;
+}
+
+int ConsoleWriter::LineBuffer::sync() {
+    publish(true);
+    return 0;
 }
 
 } // namespace libfrugi
@@ -0,0 +1,309 @@
+/*
+ * DataWriter.cpp
+ *
+ * Part of a general library.
+ *
+ * @author Freark van der Berg
+ */
+
+#include "libfrugi/DataWriter.h"
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace libfrugi {
+
+namespace {
+
+/**
+ * Returns the number of characters in the specified UTF-8 text, i.e., the
+ * number of bytes that are not continuation bytes.
+ */
+size_t displayWidth(std::string_view s) {
+    size_t width = 0;
+    for(char c: s) {
+        width += ((unsigned char)c & 0xC0) != 0x80;
+    }
+    return width;
+}
+
+} // namespace
+
+const size_t TableWriter::BLOCK_ROWS_DEFAULT = 256;
+
+const char* DataWriter::findJsonSpecial(const char* s, const char* end) {
+#if defined(__SSE2__)
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i control = _mm_set1_epi8(0x1F);
+    for(; end - s >= 16; s += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s));
+
+        // A byte is a control character if the unsigned maximum with 0x1F is 0x1F
+        __m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash)),
+                                 _mm_cmpeq_epi8(_mm_max_epu8(v, control), control));
+        int mask = _mm_movemask_epi8(m);
+        if(mask) return s + __builtin_ctz(mask);
+    }
+#endif
+    for(; s < end; ++s) {
+        unsigned char c = *s;
+        if(c < 0x20 || c == '"' || c == '\\') return s;
+    }
+    return end;
+}
+
+const char* DataWriter::findAnyOf(const char* s, const char* end, char a, char b, char c, char d) {
+#if defined(__SSE2__)
+    const __m128i va = _mm_set1_epi8(a);
+    const __m128i vb = _mm_set1_epi8(b);
+    const __m128i vc = _mm_set1_epi8(c);
+    const __m128i vd = _mm_set1_epi8(d);
+    for(; end - s >= 16; s += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s));
+        __m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb)),
+                                 _mm_or_si128(_mm_cmpeq_epi8(v, vc), _mm_cmpeq_epi8(v, vd)));
+        int mask = _mm_movemask_epi8(m);
+        if(mask) return s + __builtin_ctz(mask);
+    }
+#endif
+    for(; s < end; ++s) {
+        if(*s == a || *s == b || *s == c || *s == d) return s;
+    }
+    return end;
+}
+
+void JsonWriter::writeString(std::string_view s) {
+    static const char hex[] = "0123456789abcdef";
+    const char* p = s.data();
+    const char* end = p + s.size();
+    write('"');
+    while(p < end) {
+        const char* special = findJsonSpecial(p, end);
+        if(special > p) write(p, special - p);
+        if(special == end) break;
+        unsigned char c = *special;
+        switch(c) {
+            case '"':
+                write("\\\"", 2);
+                break;
+            case '\\':
+                write("\\\\", 2);
+                break;
+            case '\n':
+                write("\\n", 2);
+                break;
+            case '\r':
+                write("\\r", 2);
+                break;
+            case '\t':
+                write("\\t", 2);
+                break;
+            case '\b':
+                write("\\b", 2);
+                break;
+            case '\f':
+                write("\\f", 2);
+                break;
+            default: {
+                char escape[6] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xF]};
+                write(escape, 6);
+            }
+        }
+        p = special + 1;
+    }
+    write('"');
+}
+
+JsonWriter& JsonWriter::begin(char open) {
+    beginValue();
+    write(open);
+    scopes.push_back(open);
+    first = true;
+    return *this;
+}
+
+JsonWriter& JsonWriter::end(char open, char close) {
+    assert(!scopes.empty() && scopes.back() == open && !afterKey);
+    (void)open;
+    scopes.pop_back();
+    write(close);
+    first = false;
+    endValue();
+    return *this;
+}
+
+JsonWriter& JsonWriter::key(std::string_view name) {
+    assert(!scopes.empty() && scopes.back() == '{' && !afterKey);
+    if(!first) write(',');
+    first = false;
+    writeString(name);
+    write(':');
+    afterKey = true;
+    return *this;
+}
+
+JsonWriter& JsonWriter::value(const Shell::RunStatistics& statistics) {
+    beginObject();
+    field("time_user", statistics.time_user);
+    field("time_system", statistics.time_system);
+    field("time_elapsed", statistics.time_elapsed);
+    field("time_monraw", statistics.time_monraw);
+    field("mem_virtual", statistics.mem_virtual);
+    field("mem_resident", statistics.mem_resident);
+    return endObject();
+}
+
+void CsvWriter::writeString(std::string_view s) {
+    const char* p = s.data();
+    const char* end = p + s.size();
+    const char* special = findAnyOf(p, end, separator, '"', '\n', '\r');
+    if(special == end) {
+        write(p, s.size());
+        return;
+    }
+
+    // Quote the field, doubling the quotes inside it
+    write('"');
+    write(p, special - p);
+    p = special;
+    while(p < end) {
+        const char* quote = static_cast<const char*>(memchr(p, '"', end - p));
+        if(!quote) {
+            write(p, end - p);
+            break;
+        }
+        write(p, quote + 1 - p);
+        write('"');
+        p = quote + 1;
+    }
+    write('"');
+}
+
+CsvWriter& CsvWriter::field(const Shell::RunStatistics& statistics) {
+    field(statistics.time_user);
+    field(statistics.time_system);
+    field(statistics.time_elapsed);
+    field(statistics.time_monraw);
+    field(statistics.mem_virtual);
+    return field(statistics.mem_resident);
+}
+
+CsvWriter& CsvWriter::runStatisticsHeader() {
+    field("time_user");
+    field("time_system");
+    field("time_elapsed");
+    field("time_monraw");
+    field("mem_virtual");
+    return field("mem_resident");
+}
+
+void TableWriter::pad(size_t n) {
+    static const char spaces[] = "                                ";
+    while(n > sizeof(spaces) - 1) {
+        write(spaces, sizeof(spaces) - 1);
+        n -= sizeof(spaces) - 1;
+    }
+    write(spaces, n);
+}
+
+void TableWriter::writeRow() {
+    for(size_t c = 0; c < views.size(); ++c) {
+        const Column& column = columns[c];
+        size_t width = displayWidth(views[c]);
+        size_t padding = column.width > width ? column.width - width : 0;
+        if(c > 0) write(separator.data(), separator.size());
+        if(column.alignment == RIGHT) pad(padding);
+        write(views[c].data(), views[c].size());
+
+        // Trailing spaces of the last cell are left out
+        if(column.alignment != RIGHT && c + 1 < views.size()) pad(padding);
+    }
+    write('\n');
+}
+
+TableWriter& TableWriter::flush() {
+
+    // Widen the columns to fit the block
+    size_t start = 0;
+    size_t cell = 0;
+    for(size_t end: rowEnds) {
+        for(size_t c = 0; cell < end; ++c, ++cell) {
+            columns[c].width = std::max(columns[c].width,
+                                        displayWidth(std::string_view(cells.data() + start, cellEnds[cell] - start)));
+            start = cellEnds[cell];
+        }
+    }
+
+    if(!headerWritten && !rowEnds.empty()) {
+        headerWritten = true;
+        bool titled = false;
+        for(Column& column: columns) {
+            column.width = std::max(column.width, displayWidth(column.title));
+            titled |= !column.title.empty();
+        }
+        if(titled) {
+            std::string rules;
+            for(Column& column: columns) {
+                rules.append(column.width, '-');
+            }
+            views.clear();
+            for(Column& column: columns) {
+                views.emplace_back(column.title);
+            }
+            writeRow();
+            views.clear();
+            size_t offset = 0;
+            for(Column& column: columns) {
+                views.emplace_back(rules.data() + offset, column.width);
+                offset += column.width;
+            }
+            writeRow();
+        }
+    }
+
+    // Write the block
+    start = 0;
+    cell = 0;
+    for(size_t end: rowEnds) {
+        views.clear();
+        for(; cell < end; ++cell) {
+            views.emplace_back(cells.data() + start, cellEnds[cell] - start);
+            start = cellEnds[cell];
+        }
+        writeRow();
+    }
+
+    // Keep the cells of the row that is not ended yet
+    cells.erase(0, start);
+    cellEnds.erase(cellEnds.begin(), cellEnds.begin() + cell);
+    for(size_t& end: cellEnds) {
+        end -= start;
+    }
+    rowEnds.clear();
+    return *this;
+}
+
+TableWriter& TableWriter::field(const Shell::RunStatistics& statistics) {
+    field(statistics.time_user);
+    field(statistics.time_system);
+    field(statistics.time_elapsed);
+    field(statistics.time_monraw);
+    field(statistics.mem_virtual);
+    return field(statistics.mem_resident);
+}
+
+TableWriter& TableWriter::runStatisticsColumns() {
+    column("time_user");
+    column("time_system");
+    column("time_elapsed");
+    column("time_monraw");
+    column("mem_virtual");
+    return column("mem_resident");
+}
+
+} // namespace libfrugi
@@ -7,10 +7,83 @@
  */
 
 #include "libfrugi/FileWriter.h"
+#include "libfrugi/AsyncSink.h"
+
+#include <errno.h>
 
 namespace libfrugi {
 
 const FileWriter::FileWriterOption FileWriter::_pop(FileWriter::FileWriterOption::POP);
 const FileWriter::FileWriterOption FileWriter::_push(FileWriter::FileWriterOption::PUSH);
 
+const size_t FileWriter::HIGH_WATER_MARK_DEFAULT = 1024 * 1024;
+
+int FileWriter::open(const string& path, size_t highWaterMark) {
+    FileDescriptorSink* fileSink;
+    int result = FileDescriptorSink::open(path, fileSink);
+    if(result) return result;
+    return setSink(fileSink, highWaterMark);
+}
+
+int FileWriter::open(int fd, size_t highWaterMark) {
+    return setSink(new FileDescriptorSink(fd), highWaterMark);
+}
+
+int FileWriter::openIfChanged(const string& path, size_t highWaterMark) {
+    ChangedFileSink* changedSink;
+    int result = ChangedFileSink::open(path, changedSink);
+    if(result) return result;
+    return setSink(changedSink, highWaterMark);
+}
+
+int FileWriter::openMapped(const string& path, size_t highWaterMark) {
+    MappedFileSink* mappedSink;
+    int result = MappedFileSink::open(path, mappedSink);
+    if(result) return result;
+    return setSink(mappedSink, highWaterMark);
+}
+
+int FileWriter::openCompressed(const string& path, CompressingSink::Format format, size_t highWaterMark) {
+    if(!CompressingSink::isSupported(format)) return ENOTSUP;
+    FileDescriptorSink* fileSink;
+    int result = FileDescriptorSink::open(path, fileSink);
+    if(result) return result;
+    return setSink(new AsyncSink(new CompressingSink(fileSink, format)), highWaterMark);
+}
+
+int FileWriter::checkpoint() {
+    int result = flush();
+    if(result) return result;
+    return sink ? sink->sync() : 0;
+}
+
+int FileWriter::flush() {
+    if(!sink) return 0;
+    SegmentBuffer::ChunkList chunks = bottom->buffer().take(false);
+    if(!chunks.empty()) {
+        sink->write(std::move(chunks));
+    }
+    return sink->flush();
+}
+
+int FileWriter::close() {
+    if(!sink) return 0;
+    while(sss.size() > 1) {
+        pop();
+    }
+
+    // Holes that are still open are written as if they were empty
+    SegmentBuffer::ChunkList chunks = bottom->buffer().takeAll();
+    if(!chunks.empty()) {
+        sink->write(std::move(chunks));
+    }
+    int result = sink->flush();
+    int closeResult = sink->close();
+    if(!result) result = closeResult;
+    bottom->buffer().setSink(nullptr, 0);
+    delete sink;
+    sink = nullptr;
+    return result;
+}
+
 } // namespace libfrugi
@@ -0,0 +1,148 @@
+/*
+ * LogQueue.cpp
+ *
+ * Part of a general library.
+ *
+ * @author Freark van der Berg
+ */
+
+#include "libfrugi/LogQueue.h"
+
+#include <chrono>
+#include <cstdint>
+
+namespace libfrugi {
+
+const size_t LogQueue::CAPACITY_DEFAULT = 1024;
+
+LogQueue::LogQueue(ConsoleWriter& writer, size_t capacity, OverflowPolicy policy)
+        : writer(writer), policy(policy), enqueuePos(0), dequeuePos(0), dropped(0), stalls(0), sleeping(false),
+          stopping(false), reportedDropped(0) {
+    size_t size = 2;
+    while(size < capacity) size <<= 1;
+    slots = new Slot[size];
+    mask = size - 1;
+    for(size_t i = 0; i < size; ++i) {
+        slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    thread = std::thread(&LogQueue::run, this);
+}
+
+LogQueue::~LogQueue() {
+    stopping.store(true, std::memory_order_seq_cst);
+    wake();
+    thread.join();
+    delete[] slots;
+}
+
+bool LogQueue::tryPush(std::string& record) {
+    size_t pos = enqueuePos.load(std::memory_order_relaxed);
+    for(;;) {
+        Slot& slot = slots[pos & mask];
+        size_t sequence = slot.sequence.load(std::memory_order_acquire);
+        intptr_t difference = (intptr_t)sequence - (intptr_t)pos;
+        if(difference == 0) {
+            if(enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                slot.record.swap(record);
+                slot.sequence.store(pos + 1, std::memory_order_seq_cst);
+                return true;
+            }
+        } else if(difference < 0) {
+
+            // The slot still holds the record of the previous round
+            return false;
+        } else {
+            pos = enqueuePos.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+bool LogQueue::push(std::string& record) {
+    if(tryPush(record)) {
+        wake();
+        return true;
+    }
+    if(policy != BLOCK) {
+        dropped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    stalls.fetch_add(1, std::memory_order_relaxed);
+    for(unsigned int attempt = 0; !tryPush(record); ++attempt) {
+        wake();
+        if(attempt < 64) {
+            std::this_thread::yield();
+        } else {
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+    }
+    wake();
+    return true;
+}
+
+size_t LogQueue::consume() {
+    size_t pos = dequeuePos.load(std::memory_order_relaxed);
+    size_t n = 0;
+    std::ostream& out = writer.ss();
+    for(;;) {
+        Slot& slot = slots[pos & mask];
+        if(slot.sequence.load(std::memory_order_acquire) != pos + 1) break;
+
+        // Hand the slot back before writing, leaving it an empty string
+        scratch.swap(slot.record);
+        slot.sequence.store(pos + mask + 1, std::memory_order_release);
+        ++pos;
+        ++n;
+        out.write(scratch.data(), scratch.size());
+        scratch.clear();
+    }
+    if(policy == COUNT) {
+        size_t total = dropped.load(std::memory_order_relaxed);
+        if(total != reportedDropped) {
+            writer.forgetColorState();
+            writer << ConsoleWriter::Color::Warning << "(" << (total - reportedDropped) << " log records dropped)";
+            writer << ConsoleWriter::Color::Reset << writer.applypostfix;
+            reportedDropped = total;
+            ++n;
+        }
+    }
+    if(n) {
+        out.flush();
+        writer.forgetColorState();
+        dequeuePos.store(pos, std::memory_order_release);
+    }
+    return n;
+}
+
+void LogQueue::run() {
+    for(;;) {
+        if(consume()) continue;
+        if(stopping.load(std::memory_order_acquire)) {
+            if(consume()) continue;
+            break;
+        }
+
+        // Only the producer clearing the sleeping flag takes the lock to wake us
+        std::unique_lock<std::mutex> lock(mutex);
+        sleeping.store(true, std::memory_order_seq_cst);
+        size_t pos = dequeuePos.load(std::memory_order_relaxed);
+        if(slots[pos & mask].sequence.load(std::memory_order_seq_cst) != pos + 1
+           && !stopping.load(std::memory_order_seq_cst)) {
+            workAvailable.wait(lock);
+        }
+        sleeping.store(false, std::memory_order_relaxed);
+    }
+}
+
+void LogQueue::flush() {
+    size_t target = enqueuePos.load(std::memory_order_acquire);
+    for(unsigned int attempt = 0; dequeuePos.load(std::memory_order_acquire) < target; ++attempt) {
+        wake();
+        if(attempt < 64) {
+            std::this_thread::yield();
+        } else {
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+    }
+}
+
+} // namespace libfrugi
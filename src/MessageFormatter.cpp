@@ -7,6 +7,11 @@
  */
 
 #include "libfrugi/MessageFormatter.h"
+#include "libfrugi/BinaryLog.h"
+
+#include <algorithm>
+#include <climits>
+#include <sstream>
 
 namespace libfrugi {
 
@@ -26,91 +31,163 @@ const MessageFormatter::MessageType MessageFormatter::MessageType::Title(Message
 
 const int MessageFormatter::VERBOSITY_DEFAULT = 0;
 
-void MessageFormatter::print(const MSG& msg) {
+const MessageFormatter::MessageClass MessageFormatter::DEFAULT_CLASS;
+
+const unsigned int MessageFormatter::NO_FILE = UINT_MAX;
+
+std::atomic<unsigned long> MessageFormatter::serials(0);
 
-    const Location& loc = msg.loc;
-    const std::string& str = msg.message;
-    const MessageType& mType = msg.type;
+void MessageFormatter::print(ConsoleWriter& writer, const Location& loc, const std::string& str,
+                             const MessageType& mType, int indent, pid_t pid) {
 
-    consoleWriter << msg.pid << "|";
+    writer << pid << "|";
 
-    for(int i = msg.indent; i--;) {
-        consoleWriter << "  ";
+    for(int i = indent; i--;) {
+        writer << "  ";
     }
 
     if(mType.isError()) {
-        consoleWriter << ConsoleWriter::Color::Error;
+        writer << ConsoleWriter::Color::Error;
     } else if(mType.isWarning()) {
-        consoleWriter << ConsoleWriter::Color::Warning;
+        writer << ConsoleWriter::Color::Warning;
     } else if(mType.isNotify()) {
-        consoleWriter << ConsoleWriter::Color::Notify;
+        writer << ConsoleWriter::Color::Notify;
     } else if(mType.isAction() || mType.isTitle()) {
-        consoleWriter << ConsoleWriter::Color::Action;
+        writer << ConsoleWriter::Color::Action;
     } else if(mType.isReport()) {
         if(mType == MessageType::Success) {
-            consoleWriter << ConsoleWriter::Color::Proper;
+            writer << ConsoleWriter::Color::Proper;
         } else if(mType == MessageType::Failure) {
-            consoleWriter << ConsoleWriter::Color::Error;
+            writer << ConsoleWriter::Color::Error;
         } else {
-            consoleWriter << ConsoleWriter::Color::Notify2;
+            writer << ConsoleWriter::Color::Notify2;
         }
     } else if(mType.isFile()) {
     } else {
-        consoleWriter << ConsoleWriter::Color::Message;
+        writer << ConsoleWriter::Color::Message;
     }
 
-    loc.print(consoleWriter.ss());
+    loc.print(writer.ss());
 
     if(mType.isError()) {
-        consoleWriter << ":error:";
+        writer << ":error:";
     } else if(mType.isWarning()) {
-        consoleWriter << ":warning:";
+        writer << ":warning:";
     } else if(mType.isNotify()) {
-        consoleWriter << ":: ";
+        writer << ":: ";
         if(mType == MessageFormatter::MessageType::Notify)
-            consoleWriter << ConsoleWriter::Color::Notify2;
+            writer << ConsoleWriter::Color::Notify2;
         else
-            consoleWriter << ConsoleWriter::Color::NotifyH;
+            writer << ConsoleWriter::Color::NotifyH;
     } else if(mType.isAction() || mType.isTitle()) {
         if(mType == MessageFormatter::MessageType::Action) {
-            consoleWriter << " > ";
-            consoleWriter << ConsoleWriter::Color::Notify2;
+            writer << " > ";
+            writer << ConsoleWriter::Color::Notify2;
         } else if(mType == MessageFormatter::MessageType::Action2) {
-            consoleWriter << "   > ";
-            consoleWriter << ConsoleWriter::Color::Notify2;
+            writer << "   > ";
+            writer << ConsoleWriter::Color::Notify2;
         } else {
-            consoleWriter << "   - ";
-            consoleWriter << ConsoleWriter::Color::Reset;
+            writer << "   - ";
+            writer << ConsoleWriter::Color::Reset;
         }
     } else if(mType.isMessage()) {
     } else if(mType.isReport()) {
         if(mType == MessageType::Success) {
-            consoleWriter << " o ";
+            writer << " o ";
         } else if(mType == MessageType::Failure) {
-            consoleWriter << " x ";
+            writer << " x ";
         } else {
-            consoleWriter << " - ";
+            writer << " - ";
         }
-        consoleWriter << ConsoleWriter::Color::Reset;
+        writer << ConsoleWriter::Color::Reset;
     } else if(mType.isFile()) {
     } else {
-        consoleWriter << ":";
+        writer << ":";
     }
 
-    consoleWriter << str;
+    writer << str;
 
-    consoleWriter << ConsoleWriter::Color::Reset;
+    writer << ConsoleWriter::Color::Reset;
 
     if(mType.isTitle()) {
-        consoleWriter << ":";
+        writer << ":";
     }
 
-    consoleWriter << consoleWriter.applypostfix;
+    writer << writer.applypostfix;
+
+}
+
+std::string MessageFormatter::render(const Location& loc, const std::string& str, const MessageType& mType,
+                                     int indent, pid_t pid) {
+    struct Renderer {
+        std::ostringstream text;
+        ConsoleWriter writer;
+
+        Renderer() : writer(text) {
+        }
+    };
+    static thread_local Renderer renderer;
+
+    renderer.text.str(std::string());
+    renderer.writer.setTerminal(consoleWriter.getTerminal());
+    renderer.writer.setIgnoreColors(!consoleWriter.hasColors());
+    renderer.writer.applypostfix = consoleWriter.applypostfix;
+    renderer.writer.forgetColorState();
+    print(renderer.writer, loc, str, mType, indent, pid);
+    return renderer.text.str();
+}
+
+void MessageFormatter::Buffer::add(unsigned int id, Location& loc, const std::string& str, const MessageType& mType,
+                                   int indent, pid_t pid) {
+    unsigned int file = NO_FILE;
+    const std::string& fileName = loc.getFileName();
+    if(!fileName.empty()) {
+        auto it = fileIndex.find(fileName);
+        if(it == fileIndex.end()) {
+            it = fileIndex.emplace(fileName, fileNames.size()).first;
+            fileNames.push_back(&it->first);
+            fileFirst.push_back(0);
+        }
+        file = it->second;
+        if(!fileFirst[file]) fileFirst[file] = id;
+        loc.setFileName(std::string());
+    }
+    messages.emplace_back(id, file, loc, indent, arena.size(), str.size(), mType, pid);
+    arena.append(str);
+}
+
+void MessageFormatter::Buffer::take() {
+    takenMessages.swap(messages);
+    takenArena.swap(arena);
+    takenFileNames = fileNames;
+    takenFileFirst.swap(fileFirst);
+    fileFirst.assign(takenFileFirst.size(), 0);
+}
+
+MessageFormatter::Buffer& MessageFormatter::threadBuffer() {
+    static thread_local unsigned long cachedSerial = 0;
+    static thread_local Buffer* cached = nullptr;
+    if(cachedSerial == serial.load(std::memory_order_acquire)) return *cached;
+
+    std::lock_guard<std::mutex> lock(buffersMutex);
+    Buffer*& buffer = buffers[std::this_thread::get_id()];
+    if(!buffer) buffer = new Buffer();
+    cachedSerial = serial.load(std::memory_order_relaxed);
+    cached = buffer;
+    return *buffer;
+}
 
+void MessageFormatter::clearBuffers() {
+    std::lock_guard<std::mutex> lock(buffersMutex);
+    serial.store(++serials, std::memory_order_release);
+    for(auto& entry: buffers) {
+        delete entry.second;
+    }
+    buffers.clear();
 }
 
 void MessageFormatter::reportErrorAt(Location loc, const std::string& str, const size_t& messageClassIndex) {
-    messageAt(loc, str, MessageType::Error, getMessageClass(messageClassIndex));
+    messageAt(loc, str, MessageType::Error, findMessageClass(messageClassIndex));
     errors++;
 }
 
@@ -121,7 +198,7 @@ void MessageFormatter::reportErrorAt(Location loc, const std::string& str,
 }
 
 void MessageFormatter::reportWarningAt(Location loc, const std::string& str, const size_t& messageClassIndex) {
-    messageAt(loc, str, MessageType::Warning, getMessageClass(messageClassIndex));
+    messageAt(loc, str, MessageType::Warning, findMessageClass(messageClassIndex));
     warnings++;
 }
 
@@ -132,7 +209,7 @@ void MessageFormatter::reportWarningAt(Location loc, const std::string& str,
 }
 
 void MessageFormatter::reportActionAt(Location loc, const std::string& str, const size_t& messageClassIndex) {
-    messageAt(loc, str, MessageType::Action, getMessageClass(messageClassIndex));
+    messageAt(loc, str, MessageType::Action, findMessageClass(messageClassIndex));
 }
 
 void MessageFormatter::reportActionAt(Location loc, const std::string& str,
@@ -141,7 +218,7 @@ void MessageFormatter::reportActionAt(Location loc, const std::string& str,
 }
 
 void MessageFormatter::reportAction2At(Location loc, const std::string& str, const size_t& messageClassIndex) {
-    messageAt(loc, str, MessageType::Action2, getMessageClass(messageClassIndex));
+    messageAt(loc, str, MessageType::Action2, findMessageClass(messageClassIndex));
 }
 
 void MessageFormatter::reportAction2At(Location loc, const std::string& str,
@@ -150,7 +227,7 @@ void MessageFormatter::reportAction2At(Location loc, const std::string& str,
 }
 
 void MessageFormatter::reportAction3At(Location loc, const std::string& str, const size_t& messageClassIndex) {
-    messageAt(loc, str, MessageType::Action3, getMessageClass(messageClassIndex));
+    messageAt(loc, str, MessageType::Action3, findMessageClass(messageClassIndex));
 }
 
 void MessageFormatter::reportAction3At(Location loc, const std::string& str,
@@ -159,7 +236,7 @@ void MessageFormatter::reportAction3At(Location loc, const std::string& str,
 }
 
 void MessageFormatter::reportError(const std::string& str, const size_t& messageClassIndex) {
-    message(str, MessageType::Error, getMessageClass(messageClassIndex));
+    message(str, MessageType::Error, findMessageClass(messageClassIndex));
     errors++;
 }
 
@@ -169,7 +246,7 @@ void MessageFormatter::reportError(const std::string& str, const MessageFormatte
 }
 
 void MessageFormatter::reportWarning(const std::string& str, const size_t& messageClassIndex) {
-    message(str, MessageType::Warning, getMessageClass(messageClassIndex));
+    message(str, MessageType::Warning, findMessageClass(messageClassIndex));
     warnings++;
 }
 
@@ -179,7 +256,7 @@ void MessageFormatter::reportWarning(const std::string& str, const MessageFormat
 }
 
 void MessageFormatter::reportAction(const std::string& str, const size_t& messageClassIndex) {
-    message(str, MessageType::Action, getMessageClass(messageClassIndex));
+    message(str, MessageType::Action, findMessageClass(messageClassIndex));
 }
 
 void MessageFormatter::reportAction(const std::string& str, const MessageFormatter::MessageClass& messageClass) {
@@ -187,7 +264,7 @@ void MessageFormatter::reportAction(const std::string& str, const MessageFormatt
 }
 
 void MessageFormatter::reportAction2(const std::string& str, const size_t& messageClassIndex) {
-    message(str, MessageType::Action2, getMessageClass(messageClassIndex));
+    message(str, MessageType::Action2, findMessageClass(messageClassIndex));
 }
 
 void MessageFormatter::reportAction2(const std::string& str, const MessageFormatter::MessageClass& messageClass) {
@@ -195,7 +272,7 @@ void MessageFormatter::reportAction2(const std::string& str, const MessageFormat
 }
 
 void MessageFormatter::reportAction3(const std::string& str, const size_t& messageClassIndex) {
-    message(str, MessageType::Action3, getMessageClass(messageClassIndex));
+    message(str, MessageType::Action3, findMessageClass(messageClassIndex));
 }
 
 void MessageFormatter::reportAction3(const std::string& str, const MessageFormatter::MessageClass& messageClass) {
@@ -204,8 +281,8 @@ void MessageFormatter::reportAction3(const std::string& str, const MessageFormat
 
 void MessageFormatter::reportFile(const std::string& fileName, const std::string& contents,
                                   const size_t& messageClassIndex) {
-    message(fileName, MessageType::Title, getMessageClass(messageClassIndex));
-    message(contents, MessageType::File, getMessageClass(messageClassIndex));
+    message(fileName, MessageType::Title, findMessageClass(messageClassIndex));
+    message(contents, MessageType::File, findMessageClass(messageClassIndex));
 }
 
 void MessageFormatter::reportFile(const std::string& fileName, const std::string& contents,
@@ -215,7 +292,7 @@ void MessageFormatter::reportFile(const std::string& fileName, const std::string
 }
 
 void MessageFormatter::reportSuccess(const std::string& str, const size_t& messageClassIndex) {
-    message(str, MessageType::Success, getMessageClass(messageClassIndex));
+    message(str, MessageType::Success, findMessageClass(messageClassIndex));
 }
 
 void MessageFormatter::reportSuccess(const std::string& str, const MessageFormatter::MessageClass& messageClass) {
@@ -223,7 +300,7 @@ void MessageFormatter::reportSuccess(const std::string& str, const MessageFormat
 }
 
 void MessageFormatter::reportFailure(const std::string& str, const size_t& messageClassIndex) {
-    message(str, MessageType::Failure, getMessageClass(messageClassIndex));
+    message(str, MessageType::Failure, findMessageClass(messageClassIndex));
 }
 
 void MessageFormatter::reportFailure(const std::string& str, const MessageFormatter::MessageClass& messageClass) {
@@ -231,7 +308,7 @@ void MessageFormatter::reportFailure(const std::string& str, const MessageFormat
 }
 
 void MessageFormatter::reportNote(const std::string& str, const size_t& messageClassIndex) {
-    message(str, MessageType::Note, getMessageClass(messageClassIndex));
+    message(str, MessageType::Note, findMessageClass(messageClassIndex));
 }
 
 void MessageFormatter::reportNote(const std::string& str, const MessageFormatter::MessageClass& messageClass) {
@@ -239,7 +316,7 @@ void MessageFormatter::reportNote(const std::string& str, const MessageFormatter
 }
 
 void MessageFormatter::notify(const std::string& str, const size_t& messageClassIndex) {
-    message(str, MessageType::Notify, getMessageClass(messageClassIndex));
+    message(str, MessageType::Notify, findMessageClass(messageClassIndex));
 }
 
 void MessageFormatter::notify(const std::string& str, const MessageFormatter::MessageClass& messageClass) {
@@ -247,7 +324,7 @@ void MessageFormatter::notify(const std::string& str, const MessageFormatter::Me
 }
 
 void MessageFormatter::notifyHighlighted(const std::string& str, const size_t& messageClassIndex) {
-    message(str, MessageType::NotifyH, getMessageClass(messageClassIndex));
+    message(str, MessageType::NotifyH, findMessageClass(messageClassIndex));
 }
 
 void MessageFormatter::notifyHighlighted(const std::string& str, const MessageFormatter::MessageClass& messageClass) {
@@ -255,7 +332,7 @@ void MessageFormatter::notifyHighlighted(const std::string& str, const MessageFo
 }
 
 void MessageFormatter::message(const std::string& str, const size_t& messageClassIndex) {
-    message(str, MessageType::Message, getMessageClass(messageClassIndex));
+    message(str, MessageType::Message, findMessageClass(messageClassIndex));
 }
 
 void MessageFormatter::message(const std::string& str, const MessageFormatter::MessageClass& messageClass) {
@@ -263,7 +340,7 @@ void MessageFormatter::message(const std::string& str, const MessageFormatter::M
 }
 
 void MessageFormatter::message(const std::string& str, const MessageType& mType, const size_t& messageClassIndex) {
-    messageAt(Location(), str, mType, getMessageClass(messageClassIndex));
+    messageAt(Location(), str, mType, findMessageClass(messageClassIndex));
 }
 
 void MessageFormatter::message(const std::string& str, const MessageType& mType,
@@ -273,32 +350,47 @@ void MessageFormatter::message(const std::string& str, const MessageType& mType,
 
 void MessageFormatter::messageAt(Location loc, const std::string& str, const MessageType& mType,
                                  const size_t& messageClassIndex) {
-    messageAt(loc, str, mType, getMessageClass(messageClassIndex));
+    messageAt(loc, str, mType, findMessageClass(messageClassIndex));
 }
 
 void MessageFormatter::messageAt(Location loc, const std::string& str, const MessageType& mType,
                                  const MessageFormatter::MessageClass& messageClass) {
-    static int n = 1;
-
-    if(!messageClass.isEnabled()) {
+    if(!willPrint(messageClass)) {
         return;
     }
 
-    if(messageClass.getVerbosity() > verbosity) {
-        return;
+    if(binaryLog) {
+        binaryLog->message(loc, str, mType, _indent);
+    } else {
+        report(loc, str, mType, _indent, getpid());
     }
+}
 
-    if(m_autoFlush) {
+void MessageFormatter::replayAt(Location loc, const std::string& str, const MessageType& mType, int indent,
+                                pid_t pid) {
+    report(loc, str, mType, indent, pid);
+}
+
+void MessageFormatter::report(Location& loc, const std::string& str, const MessageType& mType, int indent,
+                              pid_t pid) {
+    if(queue) {
+        queue->push(render(loc, str, mType, indent, pid));
+    } else if(concurrent) {
+        Buffer& buffer = threadBuffer();
+        unsigned int id = nextId.fetch_add(1, std::memory_order_relaxed);
+        std::lock_guard<std::mutex> lock(buffer.mutex);
+        buffer.add(id, loc, str, mType, indent, pid);
+    } else if(m_autoFlush) {
         flush();
-        print(MSG(n++, loc, _indent, str, mType));
+        print(consoleWriter, loc, str, mType, indent, pid);
     } else {
-        messages.insert(MessageFormatter::MSG(n++, loc, _indent, str, mType));
+        mainBuffer.add(nextId.fetch_add(1, std::memory_order_relaxed), loc, str, mType, indent, pid);
     }
 }
 
 void MessageFormatter::reportErrors() {
 
-    consoleWriter << consoleWriter.applyprefix;
+    consoleWriter << consoleWriter.getApplyPrefix();
     consoleWriter << ConsoleWriter::Color::Notify << ":: ";
     consoleWriter << ConsoleWriter::Color::Notify2 << "Finished. ";
     {
@@ -323,11 +415,68 @@ void MessageFormatter::reportErrors() {
 }
 
 void MessageFormatter::flush() {
-    std::set<MSG>::iterator it = messages.begin();
-    for(; it != messages.end(); ++it) {
-        print(*it);
+    std::lock_guard<std::mutex> lock(buffersMutex);
+
+    // Take the messages out of the buffers and find the first message about
+    // each file over all buffers
+    entries.clear();
+    groups.clear();
+    auto take = [this](Buffer& buffer) {
+        {
+            std::lock_guard<std::mutex> bufferLock(buffer.mutex);
+            buffer.take();
+        }
+        for(size_t file = 0; file < buffer.takenFileFirst.size(); ++file) {
+            unsigned int first = buffer.takenFileFirst[file];
+            if(!first) continue;
+            unsigned int& group = groups.emplace(*buffer.takenFileNames[file], first).first->second;
+            if(first < group) group = first;
+        }
+        for(const MSG& msg: buffer.takenMessages) {
+            entries.emplace_back(&msg, &buffer, msg.id);
+        }
+    };
+    take(mainBuffer);
+    for(auto& entry: buffers) {
+        take(*entry.second);
     }
-    messages.clear();
+
+    if(!entries.empty()) {
+
+        // Messages about a file are grouped at the first message about it
+        for(Entry& entry: entries) {
+            if(entry.msg->file != NO_FILE) {
+                entry.group = groups.find(*entry.buffer->takenFileNames[entry.msg->file])->second;
+            }
+        }
+
+        // Ids are unique, so the order is total and a plain std::sort gives
+        // the same result as a stable sort would, without its buffer
+        std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) {
+            if(a.group != b.group) return a.group < b.group;
+            const Location& la = a.msg->loc;
+            const Location& lb = b.msg->loc;
+            if(la.getFirstLine() != lb.getFirstLine()) return la.getFirstLine() < lb.getFirstLine();
+            if(la.getFirstColumn() != lb.getFirstColumn()) return la.getFirstColumn() < lb.getFirstColumn();
+            return a.msg->id < b.msg->id;
+        });
+        for(const Entry& entry: entries) {
+            const MSG& msg = *entry.msg;
+            scratchLocation = msg.loc;
+            if(msg.file != NO_FILE) scratchLocation.setFileName(*entry.buffer->takenFileNames[msg.file]);
+            scratchText.assign(entry.buffer->takenArena, msg.offset, msg.length);
+            print(consoleWriter, scratchLocation, scratchText, msg.type, msg.indent, msg.pid);
+        }
+    }
+
+    mainBuffer.takenMessages.clear();
+    mainBuffer.takenArena.clear();
+    for(auto& entry: buffers) {
+        entry.second->takenMessages.clear();
+        entry.second->takenArena.clear();
+    }
+    if(queue) queue->flush();
+    if(binaryLog) binaryLog->flush();
 }
 
 MessageFormatter::MessageClass& MessageFormatter::getMessageClass(size_t classIndex) {
@@ -345,7 +494,7 @@ MessageFormatter::MessageClass& MessageFormatter::getMessageClass(std::string cl
 }
 
 MessageFormatter::MessageClass& MessageFormatter::newMessageClass(size_t classIndex, std::string classname) {
-    messageClasses.resize(classIndex);
+    if(classIndex >= messageClasses.size()) messageClasses.resize(classIndex + 1);
     messageClassIndex.insert(std::pair<std::string, size_t>(classname, classIndex));
     return messageClasses[classIndex];
 }
@@ -0,0 +1,377 @@
+/*
+ * OutputSink.cpp
+ *
+ * Part of a general library.
+ *
+ * @author Freark van der Berg
+ */
+
+#include "libfrugi/OutputSink.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <atomic>
+
+#include <libfrugi/Config.h>
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+namespace libfrugi {
+
+int FileDescriptorSink::open(const std::string& path, FileDescriptorSink*& sink) {
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd < 0) {
+        sink = nullptr;
+        return errno;
+    }
+    sink = new FileDescriptorSink(fd, true);
+    return 0;
+}
+
+void FileDescriptorSink::write(SegmentBuffer::ChunkList chunks) {
+    if(error || fd < 0) return;
+
+    struct iovec iov[IOV_MAX];
+    SegmentBuffer::Chunk* chunk = chunks.head;
+    while(chunk) {
+
+        // Gather as many chunks as a single writev() accepts
+        int n = 0;
+        for(; chunk && n < IOV_MAX; chunk = chunk->next) {
+            if(chunk->size == 0) continue;
+            iov[n].iov_base = chunk->data();
+            iov[n].iov_len = chunk->size;
+            ++n;
+        }
+
+        // Partial writes continue with the remaining part of the vector
+        struct iovec* v = iov;
+        while(n > 0) {
+            ssize_t written = ::writev(fd, v, n);
+            if(written < 0) {
+                if(errno == EINTR) continue;
+                error = errno;
+                return;
+            }
+            while(n > 0 && (size_t)written >= v->iov_len) {
+                written -= v->iov_len;
+                ++v;
+                --n;
+            }
+            if(n > 0) {
+                v->iov_base = (char*)v->iov_base + written;
+                v->iov_len -= written;
+            }
+        }
+    }
+}
+
+int FileDescriptorSink::sync() {
+    if(!error && fd >= 0 && ::fsync(fd)) {
+
+        // Pipes, terminals and sockets cannot be synced and need not be
+        if(errno != EINVAL && errno != EROFS) {
+            error = errno;
+        }
+    }
+    return error;
+}
+
+int FileDescriptorSink::close() {
+    if(fd >= 0 && ownsFd) {
+        if(::close(fd) && !error) {
+            error = errno;
+        }
+    }
+    fd = -1;
+    return error;
+}
+
+const size_t MappedFileSink::GROW_STEP_DEFAULT = 64 * 1024 * 1024;
+
+int MappedFileSink::open(const std::string& path, MappedFileSink*& sink, size_t growStep) {
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd < 0) {
+        sink = nullptr;
+        return errno;
+    }
+    long pageSize = sysconf(_SC_PAGESIZE);
+    growStep = (growStep + pageSize - 1) / pageSize * pageSize;
+    sink = new MappedFileSink(fd, growStep ? growStep : pageSize);
+    return 0;
+}
+
+int MappedFileSink::reserve(size_t needed) {
+    if(needed <= fileSize) return 0;
+
+    size_t newFileSize = fileSize + growStep;
+    if(newFileSize < needed) {
+        newFileSize = (needed + growStep - 1) / growStep * growStep;
+    }
+
+    // Allocate the blocks up front where possible, so running out of disk
+    // space is reported here instead of as a signal when writing the mapping
+#if LIBFRUGI_HAVE_POSIX_FALLOCATE
+    int result = posix_fallocate(fd, fileSize, newFileSize - fileSize);
+    if(result == EINVAL || result == EOPNOTSUPP) {
+        result = ftruncate(fd, newFileSize) ? errno : 0;
+    }
+    if(result) return result;
+#else
+    if(ftruncate(fd, newFileSize)) return errno;
+#endif
+    fileSize = newFileSize;
+
+    if(fileSize > mapSize) {
+        void* newMap;
+#if defined(MREMAP_MAYMOVE)
+        if(map) {
+            newMap = mremap(map, mapSize, fileSize, MREMAP_MAYMOVE);
+        } else {
+            newMap = mmap(nullptr, fileSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+#else
+        if(map) {
+            munmap(map, mapSize);
+            map = nullptr;
+            mapSize = 0;
+        }
+        newMap = mmap(nullptr, fileSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+#endif
+        if(newMap == MAP_FAILED) return errno;
+        map = static_cast<char*>(newMap);
+        mapSize = fileSize;
+    }
+    return 0;
+}
+
+void MappedFileSink::write(SegmentBuffer::ChunkList chunks) {
+    if(error || fd < 0) return;
+    error = reserve(size + chunks.size);
+    if(error) return;
+    for(SegmentBuffer::Chunk* chunk = chunks.head; chunk; chunk = chunk->next) {
+        memcpy(map + size, chunk->data(), chunk->size);
+        size += chunk->size;
+    }
+}
+
+int MappedFileSink::sync() {
+    if(error || fd < 0) return error;
+    if(map && size > 0 && msync(map, size, MS_SYNC)) {
+        error = errno;
+        return error;
+    }
+
+    // Cut off the preallocated space, so the file only holds valid data;
+    // it is grown again by the next write
+    if(fileSize > size) {
+        if(ftruncate(fd, size)) {
+            error = errno;
+            return error;
+        }
+        fileSize = size;
+    }
+    if(::fsync(fd)) {
+        error = errno;
+    }
+    return error;
+}
+
+int MappedFileSink::close() {
+    if(fd < 0) return error;
+    if(map) {
+        munmap(map, mapSize);
+        map = nullptr;
+        mapSize = 0;
+    }
+    if(ftruncate(fd, size) && !error) {
+        error = errno;
+    }
+    if(::close(fd) && !error) {
+        error = errno;
+    }
+    fd = -1;
+    return error;
+}
+
+const size_t ChangedFileSink::BLOCK_SIZE = 64 * 1024;
+
+ChangedFileSink::ChangedFileSink(const std::string& path, int oldFd, size_t oldSize, unsigned int oldMode)
+        : path(path), oldFd(oldFd), oldSize(oldSize), oldMode(oldMode), offset(0), buffer(nullptr), out(nullptr),
+          error(0), closed(false), changed(false) {
+}
+
+int ChangedFileSink::open(const std::string& path, ChangedFileSink*& sink) {
+    sink = nullptr;
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd < 0) {
+        if(errno != ENOENT) return errno;
+        sink = new ChangedFileSink(path, -1, 0, 0);
+        return 0;
+    }
+    struct stat st;
+    if(fstat(fd, &st)) {
+        int result = errno;
+        ::close(fd);
+        return result;
+    }
+
+    // Only regular files can be replaced by a temporary file
+    if(!S_ISREG(st.st_mode)) {
+        ::close(fd);
+        return S_ISDIR(st.st_mode) ? EISDIR : EINVAL;
+    }
+    sink = new ChangedFileSink(path, fd, st.st_size, st.st_mode & 07777);
+    return 0;
+}
+
+bool ChangedFileSink::matches(const char* data, size_t n) {
+    if(oldFd < 0 || offset + n > oldSize) return false;
+    if(!buffer) {
+        buffer = static_cast<char*>(malloc(BLOCK_SIZE));
+        if(!buffer) return false;
+    }
+    size_t done = 0;
+    while(done < n) {
+        ssize_t r = ::pread(oldFd, buffer + done, n - done, offset + done);
+        if(r < 0 && errno == EINTR) continue;
+        if(r <= 0) return false;
+        done += r;
+    }
+    return memcmp(buffer, data, n) == 0;
+}
+
+int ChangedFileSink::startWriting() {
+    static std::atomic<unsigned int> counter(0);
+
+    // Use a name of our own instead of mkstemp(), so the umask applies
+    int fd = -1;
+    for(int attempt = 0; fd < 0 && attempt < 100; ++attempt) {
+        char suffix[64];
+        snprintf(suffix, sizeof(suffix), ".tmp%ld.%u", (long)getpid(), counter.fetch_add(1));
+        tempPath = path + suffix;
+        fd = ::open(tempPath.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if(fd < 0 && errno != EEXIST) break;
+    }
+    if(fd < 0) {
+        tempPath.clear();
+        return errno;
+    }
+    if(oldFd >= 0 && fchmod(fd, oldMode)) {
+        int result = errno;
+        ::close(fd);
+        unlink(tempPath.c_str());
+        tempPath.clear();
+        return result;
+    }
+    out = new FileDescriptorSink(fd, true);
+
+    // Copy the part of the existing file that matched
+    for(size_t copied = 0; copied < offset;) {
+        size_t n = offset - copied < BLOCK_SIZE ? offset - copied : BLOCK_SIZE;
+        SegmentBuffer::ChunkList chunks;
+        chunks.head = chunks.tail = SegmentBuffer::Chunk::create(n);
+        while(chunks.size < n) {
+            ssize_t r = ::pread(oldFd, chunks.head->data() + chunks.size, n - chunks.size, copied + chunks.size);
+            if(r < 0 && errno == EINTR) continue;
+            if(r <= 0) return r < 0 ? errno : EIO;
+            chunks.size += r;
+        }
+        chunks.head->size = n;
+        out->write(std::move(chunks));
+        copied += n;
+    }
+    return out->flush();
+}
+
+void ChangedFileSink::write(SegmentBuffer::ChunkList chunks) {
+    if(error || closed) return;
+    if(out) {
+        out->write(std::move(chunks));
+        return;
+    }
+
+    // Compare whole chunks and discard them until one differs
+    while(!chunks.empty()) {
+        SegmentBuffer::Chunk* chunk = chunks.head;
+        size_t done = 0;
+        while(done < chunk->size) {
+            size_t n = chunk->size - done < BLOCK_SIZE ? chunk->size - done : BLOCK_SIZE;
+            if(!matches(chunk->data() + done, n)) {
+                error = startWriting();
+                if(error) return;
+                memmove(chunk->data(), chunk->data() + done, chunk->size - done);
+                chunk->size -= done;
+                chunks.size -= done;
+                out->write(std::move(chunks));
+                return;
+            }
+            done += n;
+            offset += n;
+        }
+        chunks.head = chunk->next;
+        if(!chunks.head) chunks.tail = nullptr;
+        chunks.size -= chunk->size;
+        SegmentBuffer::Chunk::destroy(chunk);
+    }
+}
+
+int ChangedFileSink::flush() {
+    if(!error && out) {
+        error = out->flush();
+    }
+    return error;
+}
+
+int ChangedFileSink::sync() {
+    if(!error && out) {
+        error = out->sync();
+    }
+    return error;
+}
+
+int ChangedFileSink::close() {
+    if(closed) return error;
+    closed = true;
+
+    // A file that is shorter than the existing one or new differs as well
+    if(!error && !out && (oldFd < 0 || offset != oldSize)) {
+        error = startWriting();
+    }
+    if(oldFd >= 0) {
+        ::close(oldFd);
+        oldFd = -1;
+    }
+    free(buffer);
+    buffer = nullptr;
+    if(out) {
+        int result = out->close();
+        if(!error) error = result;
+        delete out;
+        out = nullptr;
+    }
+    if(!tempPath.empty()) {
+        if(!error && rename(tempPath.c_str(), path.c_str())) {
+            error = errno;
+        }
+        if(error) {
+            unlink(tempPath.c_str());
+        } else {
+            changed = true;
+        }
+    }
+    return error;
+}
+
+} // namespace libfrugi
@@ -0,0 +1,49 @@
+/*
+ * ParallelFileWriter.cpp
+ *
+ * Part of a general library.
+ *
+ * @author Freark van der Berg
+ */
+
+#include "libfrugi/ParallelFileWriter.h"
+
+namespace libfrugi {
+
+ParallelFileWriter::ParallelFileWriter(FileWriter& parent, size_t shards) : parent(parent) {
+    this->shards.reserve(shards);
+    while(shards--) {
+        createShard();
+    }
+}
+
+ParallelFileWriter::~ParallelFileWriter() {
+    for(FileWriter* shard: shards) {
+        delete shard;
+    }
+}
+
+FileWriter& ParallelFileWriter::createShard() {
+    FileWriter* shard = new FileWriter(parent.getIndentation(), parent.getPrefix(), parent.getPostfix(),
+                                       parent.getPrefixIndent());
+
+    // Whether the first line of the shard is prefixed is decided when joining
+    shard->autoPrefix = parent.autoPrefix;
+    shard->firstLinePending = parent.autoPrefix;
+    shards.push_back(shard);
+    return *shard;
+}
+
+void ParallelFileWriter::join() {
+    for(FileWriter* shard: shards) {
+        if(shard->autoPrefix && !shard->firstLinePending) {
+            parent.fill(shard->firstPrefix, parent.atLineStart ? shard->firstPrefixText : "");
+            parent.atLineStart = shard->atLineStart;
+        }
+        parent.splice(*shard);
+        delete shard;
+    }
+    shards.clear();
+}
+
+} // namespace libfrugi
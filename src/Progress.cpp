@@ -0,0 +1,120 @@
+/*
+ * Progress.cpp
+ *
+ * Part of a general library.
+ *
+ * @author Freark van der Berg
+ */
+
+#include "libfrugi/Progress.h"
+#include "libfrugi/NumberFormat.h"
+
+#include <cstdio>
+
+namespace libfrugi {
+
+const unsigned int Progress::RATE_DEFAULT = 10;
+
+Progress::Progress(ConsoleWriter& writer, unsigned int rate)
+        : writer(writer), rate(rate ? rate : RATE_DEFAULT), stopping(false), wasLineBuffered(false) {
+}
+
+Progress::~Progress() {
+    stop();
+    for(Counter* counter: counters) {
+        delete counter;
+    }
+}
+
+Progress::Counter& Progress::addCounter(const std::string& name, uint64_t total) {
+    counters.push_back(new Counter(name, total));
+    return *counters.back();
+}
+
+void Progress::start() {
+    if(renderer.joinable()) return;
+    started = lastRender = std::chrono::steady_clock::now();
+    for(Counter* counter: counters) {
+        counter->lastValue = counter->get();
+    }
+    if(!writer.getTerminal().tty) return;
+    wasLineBuffered = writer.isLineBuffered();
+    writer.setLineBuffered(true);
+    stopping = false;
+    renderer = std::thread(&Progress::run, this);
+}
+
+void Progress::stop() {
+    if(!renderer.joinable()) return;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    stopRequested.notify_all();
+    renderer.join();
+    writer.setStatusLine("");
+    writer.setLineBuffered(wasLineBuffered);
+}
+
+void Progress::run() {
+    const std::chrono::nanoseconds period(1000000000 / rate);
+    std::unique_lock<std::mutex> lock(mutex);
+    while(!stopRequested.wait_for(lock, period, [this] { return stopping; })) {
+        // Render under the lock, but do not hold it while the writer takes
+        // its own lock, so updating the progress never waits for the output
+        std::string line = renderLocked();
+        lock.unlock();
+        writer.setStatusLine(line);
+        lock.lock();
+    }
+}
+
+std::string Progress::render() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return renderLocked();
+}
+
+std::string Progress::renderLocked() {
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    double elapsed = std::chrono::duration<double>(now - started).count();
+    double interval = std::chrono::duration<double>(now - lastRender).count();
+    lastRender = now;
+
+    std::string line;
+    char buffer[NumberFormat::CHARS_MAX];
+    if(!title.empty()) {
+        line += title;
+        line += ' ';
+    }
+    snprintf(buffer, sizeof(buffer), "[%.1fs]", elapsed);
+    line += buffer;
+
+    for(Counter* counter: counters) {
+        uint64_t value = counter->get();
+        line += ' ';
+        line += counter->name;
+        line += ": ";
+        line.append(buffer, NumberFormat::format(buffer, value));
+        if(counter->total) {
+            line += '/';
+            line.append(buffer, NumberFormat::format(buffer, counter->total));
+            snprintf(buffer, sizeof(buffer), " (%.1f%%)", 100.0 * value / counter->total);
+            line += buffer;
+        }
+        if(interval > 0 && value >= counter->lastValue) {
+            double perSecond = (value - counter->lastValue) / interval;
+            if(perSecond >= 1e6) {
+                snprintf(buffer, sizeof(buffer), " %.1fM/s", perSecond / 1e6);
+            } else if(perSecond >= 1e3) {
+                snprintf(buffer, sizeof(buffer), " %.1fk/s", perSecond / 1e3);
+            } else {
+                snprintf(buffer, sizeof(buffer), " %.0f/s", perSecond);
+            }
+            line += buffer;
+        }
+        counter->lastValue = value;
+    }
+    return line;
+}
+
+} // namespace libfrugi
@@ -0,0 +1,499 @@
+/*
+ * SegmentBuffer.cpp
+ *
+ * Part of a general library.
+ *
+ * @author Freark van der Berg
+ */
+
+#include "libfrugi/SegmentBuffer.h"
+#include "libfrugi/OutputSink.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+namespace libfrugi {
+
+const size_t SegmentBuffer::CHUNK_SIZE_MIN = 256;
+const size_t SegmentBuffer::CHUNK_SIZE_MAX = 64 * 1024;
+const size_t SegmentBuffer::SPLICE_COPY_MAX = 1024;
+const size_t SegmentBuffer::POOL_SIZE_MAX = 1024 * 1024;
+
+namespace {
+
+std::atomic<size_t> allocatedChunks(0);
+std::atomic<size_t> reusedChunks(0);
+
+} // namespace
+
+/**
+ * The chunks other threads returned to a pool, as a lock-free stack. The
+ * home lives as long as its pool or any chunk allocated by that pool,
+ * whichever is longer. When the pool is destroyed, the stack is closed and
+ * chunks returned after that are freed instead.
+ */
+class SegmentBuffer::ChunkHome {
+public:
+    std::atomic<Chunk*> returned;
+    std::atomic<size_t> refs;
+
+    ChunkHome() : returned(nullptr), refs(1) {
+    }
+
+    /**
+     * Returns the specified chunk to the pool, or frees it if the pool is
+     * gone.
+     */
+    void give(Chunk* chunk) {
+        Chunk* top = returned.load(std::memory_order_relaxed);
+        do {
+            if(top == closed()) {
+                free(chunk);
+                unref();
+                return;
+            }
+            chunk->next = top;
+        } while(!returned.compare_exchange_weak(top, chunk, std::memory_order_release, std::memory_order_relaxed));
+    }
+
+    /**
+     * Takes all returned chunks out of the stack.
+     */
+    Chunk* take() {
+        return returned.exchange(nullptr, std::memory_order_acquire);
+    }
+
+    /**
+     * Closes the stack and returns the chunks in it.
+     */
+    Chunk* close() {
+        return returned.exchange(closed(), std::memory_order_acquire);
+    }
+
+    void unref() {
+        if(refs.fetch_sub(1, std::memory_order_acq_rel) == 1) delete this;
+    }
+
+    static Chunk* closed() {
+        return reinterpret_cast<Chunk*>(1);
+    }
+};
+
+namespace {
+
+/**
+ * Per-thread lists of destroyed chunks, one for each power of two capacity
+ * between CHUNK_SIZE_MIN and CHUNK_SIZE_MAX. Chunks that other threads
+ * returned are moved into the lists when a list runs empty.
+ */
+class ChunkPool {
+public:
+    static const int CLASSES = 16;
+
+    SegmentBuffer::Chunk* chunks[CLASSES];
+    size_t count[CLASSES];
+    SegmentBuffer::ChunkHome* home;
+    bool alive;
+
+    ChunkPool() : chunks{}, count{}, home(new SegmentBuffer::ChunkHome()), alive(true) {
+    }
+
+    ~ChunkPool() {
+        alive = false;
+        for(int c = 0; c < CLASSES; ++c) {
+            release(chunks[c]);
+        }
+        release(home->close());
+        home->unref();
+    }
+
+    /**
+     * Frees the specified list of chunks of this pool.
+     */
+    void release(SegmentBuffer::Chunk* chunk) {
+        while(chunk) {
+            SegmentBuffer::Chunk* next = chunk->next;
+            free(chunk);
+            home->unref();
+            chunk = next;
+        }
+    }
+
+    /**
+     * Adds the specified chunk of this pool to the list of its class, or
+     * frees it if the list is full.
+     */
+    void put(int c, SegmentBuffer::Chunk* chunk) {
+        if((count[c] + 1) * chunk->capacity <= SegmentBuffer::POOL_SIZE_MAX) {
+            chunk->next = chunks[c];
+            chunks[c] = chunk;
+            ++count[c];
+        } else {
+            free(chunk);
+            home->unref();
+        }
+    }
+
+    /**
+     * Moves the chunks that other threads returned into the lists.
+     */
+    void reclaim() {
+        SegmentBuffer::Chunk* chunk = home->take();
+        while(chunk) {
+            SegmentBuffer::Chunk* next = chunk->next;
+            put(getClass(chunk->capacity), chunk);
+            chunk = next;
+        }
+    }
+
+    /**
+     * Returns the index of the list for chunks of the specified capacity, or
+     * -1 if chunks of that capacity are not pooled.
+     */
+    static int getClass(size_t capacity) {
+        if(capacity > SegmentBuffer::CHUNK_SIZE_MAX || (capacity & (capacity - 1))) return -1;
+        int c = 0;
+        for(size_t s = SegmentBuffer::CHUNK_SIZE_MIN; s < capacity; s *= 2) {
+            ++c;
+        }
+        if(capacity < SegmentBuffer::CHUNK_SIZE_MIN || c >= CLASSES) return -1;
+        return c;
+    }
+};
+
+thread_local ChunkPool pool;
+
+} // namespace
+
+SegmentBuffer::Chunk* SegmentBuffer::Chunk::create(size_t capacity) {
+    Chunk* chunk;
+    int c = ChunkPool::getClass(capacity);
+    if(c >= 0 && !pool.chunks[c] && pool.alive && pool.home->returned.load(std::memory_order_relaxed)) {
+        pool.reclaim();
+    }
+    if(c >= 0 && pool.chunks[c]) {
+        chunk = pool.chunks[c];
+        pool.chunks[c] = chunk->next;
+        --pool.count[c];
+        reusedChunks.fetch_add(1, std::memory_order_relaxed);
+    } else {
+        void* mem = malloc(sizeof(Chunk) + capacity);
+        if(!mem) throw std::bad_alloc();
+        chunk = static_cast<Chunk*>(mem);
+
+        // Chunks created after the pool is gone are not pooled at all
+        chunk->home = pool.alive ? pool.home : nullptr;
+        if(chunk->home) chunk->home->refs.fetch_add(1, std::memory_order_relaxed);
+        allocatedChunks.fetch_add(1, std::memory_order_relaxed);
+    }
+    chunk->next = nullptr;
+    chunk->size = 0;
+    chunk->capacity = capacity;
+    chunk->flags = 0;
+    return chunk;
+}
+
+void SegmentBuffer::Chunk::destroy(Chunk* chunk) {
+    int c = ChunkPool::getClass(chunk->capacity);
+    ChunkHome* home = chunk->home;
+
+    // The pool may already be gone when buffers are destroyed at thread exit
+    if(c >= 0 && pool.alive && home == pool.home) {
+        pool.put(c, chunk);
+    } else if(c >= 0 && home) {
+        home->give(chunk);
+    } else {
+        free(chunk);
+        if(home) home->unref();
+    }
+}
+
+size_t SegmentBuffer::getAllocatedChunks() {
+    return allocatedChunks.load(std::memory_order_relaxed);
+}
+
+size_t SegmentBuffer::getReusedChunks() {
+    return reusedChunks.load(std::memory_order_relaxed);
+}
+
+void SegmentBuffer::ChunkList::append(ChunkList&& other) {
+    if(other.empty()) return;
+    if(tail) {
+        tail->next = other.head;
+    } else {
+        head = other.head;
+    }
+    tail = other.tail;
+    size += other.size;
+    other.head = other.tail = nullptr;
+    other.size = 0;
+}
+
+void SegmentBuffer::ChunkList::clear() {
+    while(head) {
+        Chunk* next = head->next;
+        Chunk::destroy(head);
+        head = next;
+    }
+    tail = nullptr;
+    size = 0;
+}
+
+SegmentBuffer::~SegmentBuffer() {
+    closeHoles();
+    while(head) {
+        Chunk* next = head->next;
+        Chunk::destroy(head);
+        head = next;
+    }
+}
+
+void SegmentBuffer::grow(size_t minimum) {
+    syncTail();
+    drainIfNeeded(false);
+    size_t capacity = nextCapacity;
+    if(nextCapacity < CHUNK_SIZE_MAX) {
+        nextCapacity *= 2;
+    }
+    if(capacity < minimum) {
+        capacity = minimum;
+    }
+    Chunk* chunk = Chunk::create(capacity);
+    if(tail) {
+        tail->next = chunk;
+    } else {
+        head = chunk;
+    }
+    tail = chunk;
+    attachTail();
+}
+
+SegmentBuffer::int_type SegmentBuffer::overflow(int_type c) {
+    if(traits_type::eq_int_type(c, traits_type::eof())) {
+        return traits_type::not_eof(c);
+    }
+    grow(1);
+    *pptr() = traits_type::to_char_type(c);
+    pbump(1);
+    return c;
+}
+
+std::streamsize SegmentBuffer::xsputn(const char_type* s, std::streamsize n) {
+    size_t remaining = n;
+    while(remaining > 0) {
+        size_t available = epptr() - pptr();
+        if(available == 0) {
+            grow(remaining);
+            continue;
+        }
+        size_t k = remaining < available ? remaining : available;
+        memcpy(pptr(), s, k);
+        s += k;
+        remaining -= k;
+        advance(k);
+    }
+    return n;
+}
+
+SegmentBuffer::pos_type SegmentBuffer::seekoff(off_type off, std::ios_base::seekdir dir,
+                                               std::ios_base::openmode which) {
+    if(off == 0 && dir == std::ios_base::cur && (which & std::ios_base::out)) {
+        return pos_type(off_type(size()));
+    }
+    return pos_type(off_type(-1));
+}
+
+void SegmentBuffer::splice(SegmentBuffer& other) {
+    if(&other == this) return;
+    other.syncTail();
+
+    // Contents consisting of only holes are moved as well, so they stay open
+    if(other.syncedSize == 0 && other.holes.empty()) return;
+    syncTail();
+
+    // Small contents are cheaper to copy than to link
+    if(other.syncedSize <= SPLICE_COPY_MAX && other.holes.empty() && tail
+       && tail->capacity - tail->size >= other.syncedSize) {
+        for(Chunk* chunk = other.head; chunk; chunk = chunk->next) {
+            memcpy(tail->data() + tail->size, chunk->data(), chunk->size);
+            tail->size += chunk->size;
+            syncedSize += chunk->size;
+        }
+        attachTail();
+        other.clear();
+        return;
+    }
+
+    // Do not keep an unused chunk in front of the spliced contents
+    if(head && head == tail && head->size == 0) {
+        Chunk::destroy(head);
+        head = tail = nullptr;
+    }
+
+    if(tail) {
+        tail->next = other.head;
+    } else {
+        head = other.head;
+    }
+    tail = other.tail;
+    syncedSize += other.syncedSize;
+    if(nextCapacity < other.nextCapacity) {
+        nextCapacity = other.nextCapacity;
+    }
+    attachTail();
+
+    for(std::shared_ptr<HoleState>& hole: other.holes) {
+        hole->owner = this;
+        holes.push_back(std::move(hole));
+    }
+    other.holes.clear();
+
+    other.head = other.tail = nullptr;
+    other.syncedSize = 0;
+    other.nextCapacity = CHUNK_SIZE_MIN;
+    other.attachTail();
+
+    drainIfNeeded(true);
+}
+
+void SegmentBuffer::closeHoles() {
+    for(const std::shared_ptr<HoleState>& hole: holes) {
+        hole->chunk->flags &= ~Chunk::HOLE;
+        hole->chunk = nullptr;
+        hole->owner = nullptr;
+    }
+    holes.clear();
+}
+
+void SegmentBuffer::clear() {
+    closeHoles();
+    if(!head) return;
+    Chunk* chunk = head->next;
+    while(chunk) {
+        Chunk* next = chunk->next;
+        Chunk::destroy(chunk);
+        chunk = next;
+    }
+    head->next = nullptr;
+    head->size = 0;
+    head->flags = 0;
+    tail = head;
+    syncedSize = 0;
+    attachTail();
+}
+
+SegmentBuffer::ChunkList SegmentBuffer::take(bool keepTail) {
+    syncTail();
+    ChunkList list;
+
+    // Take everything up to the tail or the first open hole
+    Chunk* stop = keepTail ? tail : nullptr;
+    if(!holes.empty()) {
+        for(Chunk* chunk = head; chunk != stop; chunk = chunk->next) {
+            if(chunk->flags & Chunk::HOLE) {
+                stop = chunk;
+                break;
+            }
+        }
+    }
+    if(head == stop) return list;
+
+    Chunk* last = head;
+    size_t n = head->size;
+    while(last->next != stop) {
+        last = last->next;
+        n += last->size;
+    }
+    last->next = nullptr;
+    list.head = head;
+    list.tail = last;
+    list.size = n;
+    head = stop;
+    syncedSize -= n;
+    if(!stop) {
+        tail = nullptr;
+        attachTail();
+    }
+    return list;
+}
+
+SegmentBuffer::ChunkList SegmentBuffer::takeAll() {
+    closeHoles();
+    return take(false);
+}
+
+SegmentBuffer::Hole SegmentBuffer::reserveHole() {
+    syncTail();
+    Chunk* hole = Chunk::create(0);
+    hole->flags = Chunk::HOLE;
+    holes.push_back(std::make_shared<HoleState>(HoleState{hole, this}));
+    if(tail) {
+        tail->next = hole;
+    } else {
+        head = hole;
+    }
+    tail = hole;
+    attachTail();
+
+    // A hole is never the tail, so filling it never changes the tail
+    grow(1);
+    return Hole(holes.back());
+}
+
+void SegmentBuffer::fill(Hole& hole, const char* s, size_t n) {
+    if(!hole.isOpen()) return;
+    Chunk* chunk = hole.state->chunk;
+    SegmentBuffer* owner = hole.state->owner;
+    chunk->flags &= ~Chunk::HOLE;
+    hole.state->chunk = nullptr;
+    hole.state->owner = nullptr;
+    for(auto it = owner->holes.begin(); it != owner->holes.end(); ++it) {
+        if(*it == hole.state) {
+            owner->holes.erase(it);
+            break;
+        }
+    }
+    hole.state.reset();
+    if(n > 0) {
+        Chunk* filler = Chunk::create(n);
+        memcpy(filler->data(), s, n);
+        filler->size = n;
+        filler->next = chunk->next;
+        chunk->next = filler;
+        owner->syncedSize += n;
+    }
+
+    // The contents held back by the hole may be written now
+    owner->syncTail();
+    owner->drainIfNeeded(true);
+}
+
+void SegmentBuffer::drainIfNeeded(bool keepTail) {
+    if(sink && syncedSize > 0 && syncedSize >= highWaterMark) {
+        ChunkList chunks = take(keepTail);
+        if(!chunks.empty()) {
+            sink->write(std::move(chunks));
+        }
+    }
+}
+
+void SegmentBuffer::appendTo(std::string& s) const {
+    s.reserve(s.size() + size());
+    for(const Chunk* chunk = head; chunk; chunk = chunk->next) {
+        size_t n = chunk->size;
+        if(chunk == tail) n += pptr() - pbase();
+        s.append(chunk->data(), n);
+    }
+}
+
+void SegmentBuffer::writeTo(std::ostream& out) const {
+    for(const Chunk* chunk = head; chunk; chunk = chunk->next) {
+        size_t n = chunk->size;
+        if(chunk == tail) n += pptr() - pbase();
+        out.write(chunk->data(), n);
+    }
+}
+
+} // namespace libfrugi
@@ -0,0 +1,239 @@
+/*
+ * BinaryLogTest.cpp
+ *
+ * Part of a general library.
+ *
+ * @author Freark van der Berg
+ */
+
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "libfrugi/BinaryLog.h"
+
+using namespace libfrugi;
+
+namespace {
+
+typedef MessageFormatter::MessageType MessageType;
+
+const char* const PATH = "frugi-test-binarylog.log";
+const int THREADS = 4;
+const int MESSAGES = 5000;
+
+int failures = 0;
+
+void check(bool condition, const char* what) {
+    if(!condition) {
+        std::cerr << "FAILED: " << what << std::endl;
+        ++failures;
+    }
+}
+
+void check(size_t actual, size_t expected, const char* what) {
+    if(actual != expected) {
+        std::cerr << "FAILED: " << what << ": expected " << expected << ", got " << actual << std::endl;
+        ++failures;
+    }
+}
+
+void check(const std::string& actual, const std::string& expected, const char* what) {
+    if(actual != expected) {
+        std::cerr << "FAILED: " << what << ": expected '" << expected << "', got '" << actual << "'" << std::endl;
+        ++failures;
+    }
+}
+
+/**
+ * Renders the log at PATH, returning the result of decode().
+ */
+int decode(std::string& text) {
+    std::ostringstream out;
+    MessageFormatter formatter(out);
+    int result = BinaryLog::decode(PATH, formatter, false);
+    formatter.flush();
+    text = out.str();
+    return result;
+}
+
+/**
+ * The lines of a text, each without what precedes the message itself.
+ */
+std::vector<std::string> decodedMessages(const std::string& text) {
+    std::vector<std::string> result;
+    std::istringstream in(text);
+    std::string line;
+    while(std::getline(in, line)) {
+        size_t p = line.find(" > ");
+        result.push_back(p == std::string::npos ? line : line.substr(p + 3));
+    }
+    return result;
+}
+
+} // namespace
+
+int main() {
+
+    // Every argument type is rendered as it would be formatted directly
+    {
+        BinaryLog log;
+        check(log.open(PATH) == 0, "open");
+        const char* none = nullptr;
+        LIBFRUGI_LOG(log, MessageType::Action, "plain");
+        LIBFRUGI_LOG(log, MessageType::Action, "i={} u={} d={}", -42, 42u, 0.5);
+        LIBFRUGI_LOG(log, MessageType::Action, "b={} c={} s={} n='{}'", true, 'x', std::string("text"), none);
+        LIBFRUGI_LOG(log, MessageType::Action, "more {} than {}", 1);
+        LIBFRUGI_LOG(log, MessageType::Action, "long {}", std::string(BinaryLog::STRING_MAX + 10, 'y'));
+        check(log.close() == 0, "close");
+
+        std::string text;
+        check(decode(text) == 0, "decode");
+        std::vector<std::string> decoded = decodedMessages(text);
+        check(decoded.size(), 5, "messages decoded");
+        if(decoded.size() == 5) {
+            check(decoded[0], "plain", "message without arguments");
+            check(decoded[1], "i=-42 u=42 d=0.5", "numbers");
+            check(decoded[2], "b=true c=x s=text n=''", "booleans, characters and strings");
+            check(decoded[3], "more 1 than {}", "missing argument");
+            check(decoded[4], "long " + std::string(BinaryLog::STRING_MAX, 'y'), "truncated string");
+        }
+    }
+
+    // The messages of many threads all arrive, each thread's in order, also
+    // when the ring buffers are small and wrap around
+    {
+        BinaryLog log;
+        check(log.open(PATH, 4096) == 0, "open with small rings");
+        std::vector<std::thread> threads;
+        for(int t = 0; t < THREADS; ++t) {
+            threads.emplace_back([&log, t] {
+                for(int i = 0; i < MESSAGES; ++i) {
+                    LIBFRUGI_LOG(log, MessageType::Action, "t{} i{} {}", t, i, std::string(i % 50, 'z'));
+                }
+            });
+        }
+        for(auto& thread: threads) {
+            thread.join();
+        }
+        check(log.close() == 0, "close after threads");
+        check(log.getDropped(), 0, "messages dropped");
+
+        std::string text;
+        check(decode(text) == 0, "decode after threads");
+        std::vector<std::string> decoded = decodedMessages(text);
+        check(decoded.size(), (size_t)THREADS * MESSAGES, "messages of all threads decoded");
+        std::vector<int> next(THREADS, 0);
+        bool ordered = true;
+        for(const std::string& message: decoded) {
+            int t, i;
+            if(sscanf(message.c_str(), "t%d i%d", &t, &i) != 2 || t < 0 || t >= THREADS) {
+                check(false, "message text after threads");
+                continue;
+            }
+            if(i != next[t]) ordered = false;
+            next[t] = i + 1;
+        }
+        check(ordered, "messages of each thread in order");
+    }
+
+    // Messages of threads taking turns are merged in the order they were
+    // logged, although they are in different ring buffers
+    {
+        BinaryLog log;
+        check(log.open(PATH) == 0, "open for turns");
+        std::mutex mutex;
+        std::condition_variable turnTaken;
+        int turn = 0;
+        std::vector<std::thread> threads;
+        for(int t = 0; t < 2; ++t) {
+            threads.emplace_back([&, t] {
+                for(int i = t; i < 200; i += 2) {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    turnTaken.wait(lock, [&] { return turn == i; });
+                    LIBFRUGI_LOG(log, MessageType::Action, "turn {}", i);
+                    ++turn;
+                    turnTaken.notify_all();
+                }
+            });
+        }
+        for(auto& thread: threads) {
+            thread.join();
+        }
+        check(log.close() == 0, "close after turns");
+
+        std::string text;
+        check(decode(text) == 0, "decode after turns");
+        std::vector<std::string> decoded = decodedMessages(text);
+        check(decoded.size(), 200, "turns decoded");
+        bool merged = true;
+        for(size_t i = 0; i < decoded.size(); ++i) {
+            if(decoded[i] != "turn " + std::to_string(i)) merged = false;
+        }
+        check(merged, "turns merged in order");
+    }
+
+    // Reports through a MessageFormatter decode to what it would print
+    {
+        std::ostringstream direct;
+        {
+            MessageFormatter formatter(direct);
+            formatter.reportErrorAt(Location("model.x", 3, 5, 3, 9), "bad thing");
+            formatter.indent();
+            formatter.reportWarning("indented warning");
+            formatter.flush();
+        }
+        {
+            BinaryLog log;
+            check(log.open(PATH) == 0, "open for a formatter");
+            std::ostringstream unused;
+            MessageFormatter formatter(unused);
+            formatter.setBinaryLog(&log);
+            formatter.reportErrorAt(Location("model.x", 3, 5, 3, 9), "bad thing");
+            formatter.indent();
+            formatter.reportWarning("indented warning");
+            formatter.flush();
+            formatter.setBinaryLog(nullptr);
+            check(log.close() == 0, "close for a formatter");
+            check(unused.str(), "", "nothing printed while logging");
+        }
+        std::string text;
+        check(decode(text) == 0, "decode reports");
+        check(text, direct.str(), "reports decoded");
+    }
+
+    // A file cut short or claiming an entry larger than itself is rejected
+    {
+        std::string contents;
+        {
+            std::ifstream in(PATH, std::ios::binary);
+            std::ostringstream out;
+            out << in.rdbuf();
+            contents = out.str();
+        }
+        std::string text;
+        {
+            std::ofstream out(PATH, std::ios::binary | std::ios::trunc);
+            out.write(contents.data(), contents.size() - 3);
+        }
+        check(decode(text) == EINVAL, "truncated file rejected");
+        {
+            std::ofstream out(PATH, std::ios::binary | std::ios::trunc);
+            uint32_t entry[2] = {1, 0xFFFFFFF8};
+            out.write(contents.data(), 32);
+            out.write(reinterpret_cast<const char*>(entry), sizeof(entry));
+        }
+        check(decode(text) == EINVAL, "oversized entry rejected");
+    }
+
+    std::remove(PATH);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,101 @@
+/*
+ * HoleTest.cpp
+ *
+ * Part of a general library.
+ *
+ * @author Freark van der Berg
+ */
+
+#include <iostream>
+#include <sstream>
+
+#include "libfrugi/ConsoleWriter.h"
+#include "libfrugi/FileWriter.h"
+
+using namespace libfrugi;
+
+namespace {
+
+int failures = 0;
+
+void check(bool condition, const char* what) {
+    if(!condition) {
+        std::cerr << "FAILED: " << what << std::endl;
+        ++failures;
+    }
+}
+
+void check(const std::string& actual, const std::string& expected, const char* what) {
+    if(actual != expected) {
+        std::cerr << "FAILED: " << what << ": expected '" << expected << "', got '" << actual << "'" << std::endl;
+        ++failures;
+    }
+}
+
+} // namespace
+
+int main() {
+
+    // A segment holding nothing but a hole is moved along when popped
+    {
+        FileWriter writer;
+        writer << "count=";
+        writer.push();
+        FileWriter::Hole hole = writer.reserveHole();
+        writer.pop();
+        writer << ";";
+        check(hole.isOpen(), "hole in a popped segment stays open");
+        writer.fill(hole, "42");
+        check(writer.toString(), "count=42;", "hole in a popped segment");
+    }
+
+    // The same through several levels
+    {
+        FileWriter writer;
+        writer.push();
+        writer.push();
+        FileWriter::Hole hole = writer.reserveHole();
+        writer.pop();
+        writer.pop();
+        writer << "]";
+        writer.fill(hole, "[");
+        check(writer.toString(), "[]", "hole popped through two segments");
+    }
+
+    // Filling a hole that was cleared does nothing
+    {
+        FileWriter writer;
+        FileWriter::Hole hole = writer.reserveHole();
+        writer << "text";
+        writer.clear();
+        check(!hole.isOpen(), "hole is closed by clear()");
+        writer.fill(hole, "stale");
+        check(writer.toString(), "", "filling a cleared hole");
+    }
+
+    // Filling a hole popped onto a stream other than a segment does nothing
+    {
+        std::ostringstream out;
+        ConsoleWriter writer(out);
+        writer.push();
+        FileWriter::Hole hole = writer.reserveHole();
+        writer.pop();
+        check(!hole.isOpen(), "hole is closed when popped onto a stream");
+        writer.fill(hole, "stale");
+    }
+
+    // Filling a hole of a destroyed writer does nothing
+    {
+        FileWriter::Hole hole;
+        {
+            FileWriter writer;
+            hole = writer.reserveHole();
+        }
+        check(!hole.isOpen(), "hole is closed when its writer is destroyed");
+        FileWriter other;
+        other.fill(hole, "stale");
+        check(other.toString(), "", "filling a hole of a destroyed writer");
+    }
+
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,184 @@
+/*
+ * LogQueueTest.cpp
+ *
+ * Part of a general library.
+ *
+ * @author Freark van der Berg
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "libfrugi/ConsoleWriter.h"
+#include "libfrugi/LogQueue.h"
+
+using namespace libfrugi;
+
+namespace {
+
+const int PRODUCERS = 8;
+const int RECORDS = 5000;
+
+int failures = 0;
+
+void check(bool condition, const char* what) {
+    if(!condition) {
+        std::cerr << "FAILED: " << what << std::endl;
+        ++failures;
+    }
+}
+
+void check(size_t actual, size_t expected, const char* what) {
+    if(actual != expected) {
+        std::cerr << "FAILED: " << what << ": expected " << expected << ", got " << actual << std::endl;
+        ++failures;
+    }
+}
+
+/**
+ * A stream buffer that can be read while the consumer writes to it.
+ */
+class SharedBuffer : public std::streambuf {
+public:
+    std::mutex mutex;
+    std::string text;
+
+    std::string str() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return text;
+    }
+
+protected:
+    virtual int_type overflow(int_type c) {
+        if(c != traits_type::eof()) {
+            std::lock_guard<std::mutex> lock(mutex);
+            text += (char)c;
+        }
+        return c;
+    }
+
+    virtual std::streamsize xsputn(const char_type* s, std::streamsize n) {
+        std::lock_guard<std::mutex> lock(mutex);
+        text.append(s, n);
+        return n;
+    }
+};
+
+/**
+ * Pushes RECORDS records "p<producer> <i>" from each of PRODUCERS threads.
+ */
+void produce(LogQueue& queue) {
+    std::vector<std::thread> producers;
+    for(int p = 0; p < PRODUCERS; ++p) {
+        producers.emplace_back([&queue, p] {
+            std::string record;
+            for(int i = 0; i < RECORDS; ++i) {
+                record = "p" + std::to_string(p) + " " + std::to_string(i) + "\n";
+                queue.push(record);
+            }
+        });
+    }
+    for(auto& producer: producers) {
+        producer.join();
+    }
+}
+
+/**
+ * Checks that the records of each producer are in order, returning the
+ * number of records and setting @c notices to the number of other lines.
+ */
+size_t countRecords(const std::string& text, size_t& notices, bool& ordered) {
+    std::istringstream in(text);
+    std::string line;
+    std::vector<int> next(PRODUCERS, 0);
+    size_t records = 0;
+    notices = 0;
+    ordered = true;
+    while(std::getline(in, line)) {
+        int p, i;
+        if(sscanf(line.c_str(), "p%d %d", &p, &i) != 2 || p < 0 || p >= PRODUCERS) {
+            ++notices;
+            continue;
+        }
+        if(i < next[p]) ordered = false;
+        next[p] = i + 1;
+        ++records;
+    }
+    return records;
+}
+
+} // namespace
+
+int main() {
+
+    // With BLOCK, every record of every producer arrives, in order
+    {
+        std::ostringstream out;
+        {
+            ConsoleWriter writer(out);
+            LogQueue queue(writer, 64, LogQueue::BLOCK);
+            produce(queue);
+            queue.flush();
+            check(queue.getDropped(), 0, "records dropped with BLOCK");
+        }
+        size_t notices;
+        bool ordered;
+        check(countRecords(out.str(), notices, ordered), (size_t)PRODUCERS * RECORDS, "records written with BLOCK");
+        check(ordered, "records of each producer in order with BLOCK");
+        check(notices, 0, "other lines with BLOCK");
+    }
+
+    // With DROP and COUNT, the written and the dropped records add up
+    for(LogQueue::OverflowPolicy policy: {LogQueue::DROP, LogQueue::COUNT}) {
+        std::ostringstream out;
+        size_t dropped;
+        {
+            ConsoleWriter writer(out);
+            LogQueue queue(writer, 64, policy);
+            produce(queue);
+            queue.flush();
+            dropped = queue.getDropped();
+        }
+        size_t notices;
+        bool ordered;
+        size_t records = countRecords(out.str(), notices, ordered);
+        check(records + dropped, (size_t)PRODUCERS * RECORDS, "written and dropped records");
+        check(ordered, "records of each producer in order when dropping");
+        if(policy == LogQueue::DROP) {
+            check(notices, 0, "notices with DROP");
+        } else {
+            check(!dropped || notices > 0, "a notice with COUNT");
+        }
+    }
+
+    // A record pushed while the consumer sleeps wakes it up, without a
+    // flush() waking it as well
+    {
+        SharedBuffer buffer;
+        std::ostream out(&buffer);
+        ConsoleWriter writer(out);
+        LogQueue queue(writer, 64, LogQueue::BLOCK);
+        for(int i = 0; i < 5; ++i) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            queue.push("p0 " + std::to_string(i) + "\n");
+            auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+            size_t records = 0;
+            while(std::chrono::steady_clock::now() < deadline) {
+                size_t notices;
+                bool ordered;
+                records = countRecords(buffer.str(), notices, ordered);
+                if(records > (size_t)i) break;
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+            check(records, (size_t)i + 1, "record pushed while the consumer sleeps");
+        }
+    }
+
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,193 @@
+/*
+ * MessageFormatterTest.cpp
+ *
+ * Part of a general library.
+ *
+ * @author Freark van der Berg
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "libfrugi/MessageFormatter.h"
+
+using namespace libfrugi;
+
+namespace {
+
+const int THREADS = 8;
+const int MESSAGES = 2000;
+const int FILES = 5;
+
+int failures = 0;
+
+void check(bool condition, const char* what) {
+    if(!condition) {
+        std::cerr << "FAILED: " << what << std::endl;
+        ++failures;
+    }
+}
+
+void check(size_t actual, size_t expected, const char* what) {
+    if(actual != expected) {
+        std::cerr << "FAILED: " << what << ": expected " << expected << ", got " << actual << std::endl;
+        ++failures;
+    }
+}
+
+void check(const std::string& actual, const std::string& expected, const char* what) {
+    if(actual != expected) {
+        std::cerr << "FAILED: " << what << ": expected '" << expected << "', got '" << actual << "'" << std::endl;
+        ++failures;
+    }
+}
+
+/**
+ * Reports the messages of thread @c t: every third one is a warning
+ * without a location, the others are errors in one of FILES files. Errors
+ * are reported with message class 1, which is not registered.
+ */
+void report(MessageFormatter& formatter, int t) {
+    for(int i = 0; i < MESSAGES; ++i) {
+        std::string text = "t" + std::to_string(t) + " i" + std::to_string(i);
+        if(i % 3 == 0) {
+            formatter.reportWarning(text);
+        } else {
+            Location loc("f" + std::to_string((t + i) % FILES) + ".c", (i * 7) % 100 + 1);
+            formatter.reportErrorAt(loc, text, (size_t)1);
+        }
+    }
+}
+
+/**
+ * The lines of a text.
+ */
+std::vector<std::string> lines(const std::string& text) {
+    std::vector<std::string> result;
+    std::istringstream in(text);
+    std::string line;
+    while(std::getline(in, line)) {
+        result.push_back(line);
+    }
+    return result;
+}
+
+} // namespace
+
+int main() {
+
+    // Messages reported by many threads at once are all printed once, in
+    // the order of each thread, with the messages about a file together
+    {
+        std::ostringstream out;
+        MessageFormatter formatter(out);
+        formatter.setConcurrent(true);
+        std::vector<std::thread> threads;
+        for(int t = 0; t < THREADS; ++t) {
+            threads.emplace_back(report, std::ref(formatter), t);
+        }
+
+        // Flushing while reporting takes what was reported so far
+        for(int k = 0; k < 5; ++k) {
+            formatter.flush();
+        }
+        for(auto& thread: threads) {
+            thread.join();
+        }
+        formatter.flush();
+
+        size_t warnings = (size_t)THREADS * ((MESSAGES + 2) / 3);
+        check(formatter.getWarnings(), warnings, "warnings counted");
+        check(formatter.getErrors(), (size_t)THREADS * MESSAGES - warnings, "errors counted");
+
+        std::vector<std::string> printed = lines(out.str());
+        check(printed.size(), (size_t)THREADS * MESSAGES, "messages printed");
+        std::set<std::string> seen;
+        std::vector<int> nextWarning(THREADS, 0);
+        bool ordered = true;
+        for(const std::string& line: printed) {
+            int t, i;
+            size_t p = line.rfind(":t");
+            if(p == std::string::npos || sscanf(line.c_str() + p, ":t%d i%d", &t, &i) != 2 || t < 0 || t >= THREADS) {
+                check(false, "message text");
+                continue;
+            }
+            seen.insert(line.substr(p));
+            if(i % 3 == 0) {
+                if(i < nextWarning[t]) ordered = false;
+                nextWarning[t] = i + 1;
+            }
+        }
+        check(seen.size(), (size_t)THREADS * MESSAGES, "distinct messages printed");
+        check(ordered, "warnings of each thread in order");
+    }
+
+    // Within one flush, the messages about a file are printed together and
+    // sorted by line
+    {
+        std::ostringstream out;
+        MessageFormatter formatter(out);
+        formatter.setConcurrent(true);
+        std::vector<std::thread> threads;
+        for(int t = 0; t < THREADS; ++t) {
+            threads.emplace_back(report, std::ref(formatter), t);
+        }
+        for(auto& thread: threads) {
+            thread.join();
+        }
+        formatter.flush();
+
+        std::set<std::string> done;
+        std::string file;
+        int line = 0;
+        bool grouped = true;
+        bool sorted = true;
+        for(const std::string& text: lines(out.str())) {
+            size_t name = text.find('|') + 1;
+            size_t colon = text.find(".c:");
+            if(colon == std::string::npos) continue;
+            std::string current = text.substr(name, colon + 2 - name);
+            int currentLine = atoi(text.c_str() + colon + 3);
+            if(current != file) {
+                if(done.count(current)) grouped = false;
+                if(!file.empty()) done.insert(file);
+                file = current;
+                line = 0;
+            }
+            if(currentLine < line) sorted = false;
+            line = currentLine;
+        }
+        if(!file.empty()) done.insert(file);
+        check(done.size(), (size_t)FILES, "files printed");
+        check(grouped, "messages about a file printed together");
+        check(sorted, "messages about a file sorted by line");
+    }
+
+    // A single thread in concurrent mode prints the same as the normal mode
+    {
+        std::ostringstream normal;
+        {
+            MessageFormatter formatter(normal);
+            report(formatter, 0);
+            formatter.flush();
+        }
+        std::ostringstream concurrent;
+        {
+            MessageFormatter formatter(concurrent);
+            formatter.setConcurrent(true);
+            std::thread thread(report, std::ref(formatter), 0);
+            thread.join();
+            formatter.flush();
+        }
+        check(concurrent.str(), normal.str(), "concurrent output of one thread");
+    }
+
+    return failures ? 1 : 0;
+}
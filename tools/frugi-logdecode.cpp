@@ -0,0 +1,61 @@
+/*
+ * frugi-logdecode.cpp
+ *
+ * Part of a general library.
+ *
+ * @author Freark van der Berg
+ */
+
+#include <cstring>
+#include <iostream>
+
+#include "libfrugi/BinaryLog.h"
+
+using namespace libfrugi;
+
+namespace {
+
+void usage(const char* program) {
+    std::cerr << "usage: " << program << " [-t] [--no-color] <file>" << std::endl;
+    std::cerr << "Renders a log written by BinaryLog as text." << std::endl;
+    std::cerr << "  -t, --timestamps  prefix each message with the seconds since the log was opened" << std::endl;
+    std::cerr << "  --no-color        do not use colours, even when writing to a terminal" << std::endl;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    bool timestamps = false;
+    bool colors = true;
+    const char* path = nullptr;
+    for(int i = 1; i < argc; ++i) {
+        if(!strcmp(argv[i], "-t") || !strcmp(argv[i], "--timestamps")) {
+            timestamps = true;
+        } else if(!strcmp(argv[i], "--no-color")) {
+            colors = false;
+        } else if(!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
+            usage(argv[0]);
+            return 0;
+        } else if(argv[i][0] == '-' || path) {
+            usage(argv[0]);
+            return 2;
+        } else {
+            path = argv[i];
+        }
+    }
+    if(!path) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    MessageFormatter formatter(std::cout);
+    formatter.useColoredMessages(colors && formatter.getConsoleWriter().getTerminal().tty);
+    formatter.setAutoFlush(true);
+    int result = BinaryLog::decode(path, formatter, timestamps);
+    formatter.flush();
+    if(result) {
+        std::cerr << argv[0] << ": " << path << ": " << strerror(result) << std::endl;
+        return 1;
+    }
+    return 0;
+}